@@ -0,0 +1,11 @@
+#ifndef __BOOT_H__
+#define __BOOT_H__
+
+#include "types.h"
+#include "emulator.h"
+
+#define	BOOT_ENTRY		0x0500	/* OS entry, first OS track loaded */
+
+void	BOOTLoad(Emulator* ctx, u16 pc);
+
+#endif
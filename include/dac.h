@@ -0,0 +1,22 @@
+#ifndef __DAC_H__
+#define __DAC_H__
+
+#include <stddef.h>
+
+#include "types.h"
+
+/* 6072 DAC, "Bell μ-225 logarithm law" (see FLOPPY.md), scaled by 4 to
+ * the full 16 bit range. The float variants are scaled to [-1, 1). */
+s16	DACReference(u8 val);
+
+/* Selects the fastest kernel for the host. DACSelect picks one by name
+ * ("table", "sse2", "avx2") and fails if the host cannot run it; "make
+ * check" compares all of them with the reference. */
+void	DACInit(void);
+BOOL	DACSelect(const char* name);
+const char* DACKernel(void);
+
+void	DACDecode(s16* out, const u8* in, size_t count);
+void	DACDecodeFloat(f32* out, const u8* in, size_t count);
+
+#endif
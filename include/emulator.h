@@ -1,7 +1,12 @@
 #ifndef __EMULATOR_H__
 #define __EMULATOR_H__
 
+#include <stddef.h>
+
 #include "z80.h"
+#include "image.h"
+#include "sched.h"
+#include "input.h"
 
 #ifndef LED
 #define LED(x)		(1 << ((x) - 1))
@@ -51,6 +56,9 @@
 #define	SIO_IRQVEC_RXNE_A	6
 #define	SIO_IRQVEC_SPECIAL_A	7
 
+/* channel B character time: 31.25 kbit/s, 10 bits per character */
+#define	SIO_BYTE_CYCLES		(CPU_CLOCK / 3125)
+
 typedef struct {
 	/* WR0 */
 	u8	ptrlatch;
@@ -78,11 +86,15 @@ typedef struct {
 
 	/* data input */
 	u8	rx_data;
+	u64	rx_ready;	/* cycle at which the next byte has arrived */
 
 	u8	exi_pending;
 	u8	rx_pending;
 	u8	tx_pending;
 	u8	rxne;
+
+	u8	rx_first;	/* RX INT on first char: armed */
+	u8	tx_busy;	/* character in the transmitter */
 } SIOCH;
 
 typedef struct {
@@ -117,7 +129,8 @@ typedef struct {
 } Z80PIO;
 
 typedef struct {
-	u64	cycle_counter;
+	u64	cycle_counter;	/* timer cycles accumulated up to sync */
+	u64	sync;
 
 	u8	reset;
 	u8	trigger;
@@ -133,20 +146,60 @@ typedef struct {
 typedef struct {
 	u8	vector;
 	u8	latch;
-	u8	pending_irq;
-	u8	irq_timer;
 
 	CTCCH	channel[4];
 } Z80CTC;
 
+/* interrupt sources in daisy chain order, highest priority first; the PIO
+ * interrupt mode is not emulated, its slots never become pending */
+#define	IRQ_PIO_A		0
+#define	IRQ_PIO_B		1
+#define	IRQ_SIO_A		2
+#define	IRQ_SIO_B		3
+#define	IRQ_CTC0		4
+#define	IRQ_COUNT		8
+
+typedef struct {
+	u8	pending;
+	u8	service;	/* acknowledged, until RETI */
+	u8	vector[IRQ_COUNT];
+} DAISY;
+
+/* Idle loop accelerator: a pass is the code between two visits of the
+ * entry PC. A pass which started in the same CPU and keyboard state as the
+ * previous one, did not change RAM, only accessed the keyboard ports and
+ * saw no event or interrupt will repeat identically, so the following
+ * passes up to the next event are accounted for without executing them. */
+#define	IDLE_MAX_CYCLES		CPU_CLOCK	/* skip at most 1s at once */
+
+typedef struct {
+	u16	entry;		/* pass start PC, 0: disabled */
+	u8	armed;		/* recording a pass */
+	u8	clean;		/* recorded pass had no side effects */
+
+	u64	start;		/* cycle at the pass start */
+} IDLE;
+
+/* state at the pass start, only touched once per pass */
+typedef struct {
+	ZZ80State cpu;
+	u64	keyboard;
+	u8	keyboard2;
+	u8	kbdmux;
+	u8	forc16;
+	u8	cpua16;
+
+	u64	passes;		/* passes skipped in total */
+} IDLEPASS;
+
 #define	FDD_TRACKS		35
 #define	FDD_TRACK_SIZE		3584
 #define	FDD_SIZE		(FDD_TRACKS * FDD_TRACK_SIZE)
 #define	FDD_ROTATION		(CPU_CLOCK / 5)	/* 300 RPM = 5Hz */
+#define	FDD_INDEX_PULSE		1200		/* index pulse length in cycles */
+#define	FDD_BYTE_CYCLES		(CPU_CLOCK / 31250)	/* 250 kbit/s */
 
 typedef struct {
-	u8	timer;
-
 	u8	dir;
 	u8	sel_mtr;
 
@@ -154,10 +207,23 @@ typedef struct {
 
 	u16	state;
 
-	u32	rotation;
+	u32	rotation;	/* disk position while the motor is off */
+} FDD;
+
+/* The inserted floppy, only touched when a track is first accessed or
+ * written. Tracks of an image file are views of its mapping, decoded
+ * container tracks are copies; both are shared by content. */
+typedef struct {
+	IMAGE*	source;		/* image file or compressed container */
+	u8	packed;		/* source is a container, see fdz.h */
+	IMAGE*	tracks[FDD_TRACKS];	/* shared track data, on first access */
 
+	IMAGE*	image;		/* private copy once patched or written */
 	u8*	data;
-} FDD;
+
+	u64	dirty;		/* tracks written since the last flush */
+	u8	flushed;	/* write-back image holds the full floppy */
+} FDDDISK;
 
 typedef struct {
 	u16	addr;
@@ -171,7 +237,7 @@ typedef struct {
 	u8	addr_dec;
 	u8	mode;
 
-	u8	timer;
+	u64	next;	/* cycle of the next transfer while active */
 } DMACH;
 
 typedef struct {
@@ -193,44 +259,124 @@ typedef struct {
 	DMACH	channel[4];
 } DMA;
 
+/* one single mode transfer per DMA_TRANSFER_CYCLES, this is about the pace
+ * of the ROM loader's polling loop (~12 cycles per instruction) */
+#define	DMA_TRANSFER_CYCLES	1200
+
+struct Emulator;
+
+/* I/O port handlers. Devices register a handler for a range of ports; the
+ * handler gets the unit number passed at registration (e.g. the DMA chip
+ * select) and the register index within the range. */
+typedef u8	(*EMUPORTIN)(struct Emulator* ctx, u8 unit, u8 reg);
+typedef void	(*EMUPORTOUT)(struct Emulator* ctx, u8 unit, u8 reg, u8 data);
+
 typedef struct {
-	u8	rom[1024];
-	u8	ram[128 * 1024];
+	EMUPORTIN	handler;
+	u8		unit;
+	u8		reg;
+} EMUIN;
 
-	u8	channel_cfg_h[8];
-	u8	channel_cfg_l[8];
+typedef struct {
+	EMUPORTOUT	handler;
+	u8		unit;
+	u8		reg;
+} EMUOUT;
 
-	u8	led_reg[3];
-	u8	last_leds[3];
+typedef struct {
+	EMUIN		in[256];
+	EMUOUT		out[256];
+} EMUPORTS;
+
+#define	EMU_CACHE_LINE		64
+#define	EMU_RAM_SIZE		(128 * 1024)
+#define	EMU_PAGE_SIZE		4096	/* RAM dirty tracking granularity */
+#define	EMU_CORE_SIZE		(3 * EMU_CACHE_LINE)	/* per-step state */
+#define	EMU_HOT_SIZE		(15 * EMU_CACHE_LINE)	/* core and devices */
+
+/* The per-step device state is kept together at the start of the structure,
+ * the RAM and ROM are allocated separately and only referenced by pointer.
+ * Everything an instruction may touch (clock, event deadlines, memory
+ * mapping, interrupts, idle pass) comes first, followed by the devices which
+ * are touched by events and I/O. Pointers and bookkeeping for files and
+ * host interfaces are cold. */
+typedef struct Emulator {
+	/* hot: touched on every step or memory access */
+	u64	cycle ATTRIBUTE_ALGIN(EMU_CACHE_LINE);
+	Z80*	z80;
+
+	SCHED	sched;
+
+	u8*	rom;
+	u8*	ram;
+	u32	dirty;	/* RAM pages written since the last reset */
 
 	u8	cpua16;
 	u8	forc16;
+	DAISY	daisy;
+	u8	kbdmux;
 
-	Z80SIO	sio;
-	Z80PIO	pio;
-	Z80CTC	ctc;
+	IDLE	idle;
 
+	/* hot: touched by events and I/O */
+	Z80CTC	ctc;
 	FDD	fdd;
 
+	u32	dma_active;	/* bit dmacs * 4 + ch: channel transfers */
 	DMA	dma[5];
 
-	u8	irq;
-	u8	kbdmux;
+	Z80SIO	sio;
+	Z80PIO	pio;
 
-	u64	keyboard;
+	/* cold: port table, keyboard and channel registers, files and host
+	 * interfaces */
+	u64	keyboard ATTRIBUTE_ALGIN(EMU_CACHE_LINE);
 	u8	keyboard2;
 
-	Z80*	z80;
+	EMUPORTS* ports;
+
+	u8	channel_cfg_h[8];
+	u8	channel_cfg_l[8];
+
+	u8	led_reg[3];
+	u8	last_leds[3];
+
+	IMAGE*	rom_image;
+	u8	own_ram;
+
+	FDDDISK	disk;
+	IDLEPASS idle_pass;
+
+	struct SHMHEADER* shm;	/* live view, see shm.h */
+	const char* shm_name;
 
-	u64	cycle;
+	struct SERIAL* serial;	/* SIO channel B host bridge, see serial.h */
+	struct PANEL* panel;	/* LED change stream, see panel.h */
+	struct VOICES* voices;	/* sample voice playback, see voice.h */
+
+	u8	turbo_dma;	/* load floppy DMA transfers at once */
+	u8	fast_disk;	/* skip index and head settle waits */
+
+	INPUT*	input;		/* key timeline, replayed from reset */
 } Emulator;
 
+_Static_assert(offsetof(Emulator, ctc) <= EMU_CORE_SIZE, "per-step state exceeds EMU_CORE_SIZE");
+_Static_assert(offsetof(Emulator, keyboard) <= EMU_HOT_SIZE, "hot state exceeds EMU_HOT_SIZE");
+
 void	EMUInit(Emulator* ctx, Z80* z80, const char* rom_file);
+void	EMUInitRAM(Emulator* ctx, Z80* z80, const char* rom_file, u8* ram);
+void	EMUReset(Emulator* ctx);
+void	EMUDestroy(Emulator* ctx);
+Emulator* EMUCreate(Z80* z80, const char* rom_file);
+void	EMUDelete(Emulator* ctx);
 void	EMULoadFloppy(Emulator* ctx, const char* filename);
+u8*	EMUPatchFloppy(Emulator* ctx);
+u8*	EMUGetTrack(Emulator* ctx, unsigned int track);
 
 void	EMUPressKey(Emulator* ctx, u8 key);
 void	EMUReleaseKey(Emulator* ctx, u8 key);
 u8	EMUKeyboardToKey(u8 midi);
+void	EMUSetInput(Emulator* ctx, INPUT* input);
 
 u16	EMUGetLEDs(Emulator* ctx);
 u16	EMUGetSEQLEDs(Emulator* ctx);
@@ -240,10 +386,20 @@ void	EMUUpdateLEDs(Emulator* ctx);
 void	EMUWritePIO(Emulator* ctx, BOOL ab, BOOL cd, u8 data);
 void	EMUWriteSIO(Emulator* ctx, BOOL ab, BOOL cd, u8 data);
 
-void	EMUStep(Emulator* ctx);
+void	EMURegisterIn(Emulator* ctx, u8 base, unsigned int count, EMUPORTIN handler, u8 unit);
+void	EMURegisterOut(Emulator* ctx, u8 base, unsigned int count, EMUPORTOUT handler, u8 unit);
 
-void	EMUStepFDD(Emulator* ctx);
+u8	EMUReadCTC(Emulator* ctx, unsigned int channel);
+void	EMUWriteCTC(Emulator* ctx, unsigned int channel, u8 data);
+
+void	EMURaiseIRQ(Emulator* ctx, unsigned int source, u8 vector);
+u64	EMUNextEvent(Emulator* ctx);
+
+void	EMUStep(Emulator* ctx);
+void	EMUSkip(Emulator* ctx, u64 cycles);
+void	EMUSetIdleEntry(Emulator* ctx, u16 pc);
 
+void	EMUTransmitFDD(Emulator* ctx, u8 data);
 void	EMUSetFDDMotor(Emulator* ctx, BOOL sel_mtr);
 void	EMUSetFDDDirection(Emulator* ctx, BOOL dir);
 void	EMUSetFDDStep(Emulator* ctx, BOOL step);
@@ -253,6 +409,7 @@ void	z80write(void* context, u16 addr, u8 data);
 u8	z80in(void* context, u16 addr);
 void	z80out(void* context, u16 addr, u8 data);
 u32	z80int(void* context);
+void	z80reti(void* context);
 void	z80halt(void* context, BOOL state);
 
 u32	getaddr(Emulator* ctx, u16 addr);
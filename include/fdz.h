@@ -0,0 +1,45 @@
+#ifndef __FDZ_H__
+#define __FDZ_H__
+
+#include "types.h"
+
+#define	FDZ_MAGIC		0x5A444645	/* "EFDZ" */
+#define	FDZ_VERSION		1
+
+/* track encodings */
+#define	FDZ_ZERO		0	/* all zero, no payload */
+#define	FDZ_STORED		1	/* raw track data */
+#define	FDZ_LZ			2	/* see FDZDecode */
+
+#define	FDZ_HEADER_SIZE		12	/* header in the file */
+#define	FDZ_INDEX_SIZE		8	/* index entry in the file */
+
+/* Compressed floppy container: header with a track index, followed by the
+ * track payloads. Identical payloads are stored once. All fields are little
+ * endian, the index (one entry per track) directly follows the header:
+ *
+ *   header               index entry
+ *   0  u32  magic        0  u32  offset
+ *   4  u16  version      4  u16  length
+ *   6  u16  tracks       6  u8   method
+ *   8  u32  track_size   7  u8   reserved
+ */
+typedef struct {
+	u32	offset;		/* payload offset from the start of the file */
+	u16	length;		/* payload length */
+	u8	method;
+} FDZTRACK;
+
+typedef struct {
+	u32	magic;
+	u16	version;
+	u16	tracks;
+	u32	track_size;
+} FDZHEADER;
+
+u32	FDZProbe(const char* filename);
+BOOL	FDZCheck(const u8* data, u32 size, unsigned int tracks, unsigned int track_size);
+void	FDZDecode(const u8* data, unsigned int track, u8* out, unsigned int track_size);
+BOOL	FDZPack(const u8* data, unsigned int tracks, unsigned int track_size, const char* filename);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __FLOPPY_H__
+#define __FLOPPY_H__
+
+#include "types.h"
+#include "emulator.h"
+
+#define	FDD_JOURNAL_MAGIC	0x4C4A4446	/* "FDJL" */
+#define	FDD_JOURNAL_SIZE	16		/* record header in the file */
+
+/* Journal record header, followed by FDD_TRACK_SIZE bytes of track data.
+ * Records are only ever appended; replaying them in order reproduces the
+ * floppy contents. In the file the header is FDD_JOURNAL_SIZE bytes, all
+ * fields little endian:
+ *
+ *   0  u32  magic
+ *   4  u8   track
+ *   5  u8   reserved[3]
+ *   8  u64  cycle
+ */
+typedef struct {
+	u32	magic;
+	u8	track;
+	u64	cycle;
+} FDDJOURNAL;
+
+BOOL	FDDFlush(Emulator* ctx, const char* image_file, const char* journal_file);
+BOOL	FDDReplay(Emulator* ctx, const char* journal_file);
+
+#endif
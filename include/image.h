@@ -0,0 +1,47 @@
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include "types.h"
+
+/* Immutable, reference counted data blob (ROM, floppy image). Images created
+ * with a name are kept in a process wide cache keyed by name and size, so
+ * every emulator instance which loads the same file shares the same copy.
+ * Use IMGUnshare to get a private image before modifying the data.
+ *
+ * IMGMap maps a file MAP_PRIVATE instead of reading it: the data is paged in
+ * on demand and shared with other processes through the page cache, writes
+ * land in private copy-on-write pages.
+ *
+ * Interned images are additionally kept in a content addressed table:
+ * IMGInternView and IMGInternData return the existing image with identical
+ * contents if there is one, regardless of its name or origin. A view refers
+ * to a range of its parent's data (e.g. a track of a mapped floppy) and
+ * keeps the parent alive instead of copying it. */
+typedef struct IMAGE IMAGE;
+
+struct IMAGE {
+	IMAGE*	next;
+	char*	name;
+
+	IMAGE*	hnext;
+	u64	hash;
+	u8	interned;
+
+	u32	refs;
+	u32	size;
+	u32	mapped;	/* length of the mapping, 0 for heap data */
+	IMAGE*	parent;	/* owner of the data of a view */
+
+	u8*	data;
+};
+
+IMAGE*	IMGFind(const char* name, u32 size);
+IMAGE*	IMGCreate(const char* name, u32 size);
+IMAGE*	IMGMap(const char* filename, u32 size);
+IMAGE*	IMGInternView(IMAGE* parent, u32 offset, u32 size);
+IMAGE*	IMGInternData(const u8* data, u32 size);
+IMAGE*	IMGRetain(IMAGE* img);
+void	IMGRelease(IMAGE* img);
+IMAGE*	IMGUnshare(IMAGE* img);
+
+#endif
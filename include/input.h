@@ -0,0 +1,29 @@
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+#include "types.h"
+
+/* One key transition at an absolute CPU cycle (counted from reset). */
+typedef struct {
+	u64	cycle;
+	u8	key;		/* raw key id */
+	u8	press;
+	u8	reserved[6];
+} INPEVENT;
+
+/* Input timeline: events sorted by cycle, transitions at the same cycle
+ * keep the order in which they were added. next is the first event which
+ * was not delivered yet. */
+typedef struct INPUT {
+	INPEVENT*	events;
+	unsigned int	count;
+	unsigned int	size;
+	unsigned int	next;
+} INPUT;
+
+void	INPInit(INPUT* input);
+void	INPFree(INPUT* input);
+void	INPAdd(INPUT* input, u64 cycle, u8 key, BOOL press);
+BOOL	INPLoad(INPUT* input, const char* filename);
+
+#endif
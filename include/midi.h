@@ -0,0 +1,12 @@
+#ifndef __MIDI_H__
+#define __MIDI_H__
+
+#include "types.h"
+#include "input.h"
+
+/* MIDI note of the lowest key (key 0 for -m) */
+#define	MIDI_NOTE_BASE		36
+
+BOOL	MIDILoad(INPUT* input, const char* filename, u64 start);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef __MIXER_H__
+#define __MIXER_H__
+
+#include "types.h"
+
+/* Sums one block of voices, each a row of stride floats in [-1, 1):
+ *
+ *   out[i] = sum over v of (gain[v] + i * step[v]) * in[v * stride + i]
+ *
+ * scaled by scale, truncated and clipped to 16 bit. The rows must be 32
+ * byte aligned (stride a multiple of 8). MIXInit selects the fastest
+ * kernel for the host, MIXSelect one by name ("scalar", "sse2", "avx2") if
+ * the host can run it; "make check" compares them with the scalar one. */
+void	MIXInit(void);
+BOOL	MIXSelect(const char* name);
+const char* MIXKernel(void);
+
+void	MIXBlock(s16* out, const f32* in, unsigned int stride, const f32* gain, const f32* step, unsigned int voices, unsigned int frames, f32 scale);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef __PANEL_H__
+#define __PANEL_H__
+
+#include "types.h"
+#include "emulator.h"
+
+#define	PNL_MAGIC		0x44454C45	/* "ELED" */
+#define	PNL_VERSION		2
+#define	PNL_BUFFER		4096		/* records per write */
+#define	PNL_REGS		2		/* LED0CS, LED1CS */
+
+/* Panel stream: this header, followed by one record per change of a LED
+ * register (LED0CS, LED1CS). All fields are little endian. The stream
+ * starts with one record per register holding its current value. LED2CS
+ * is not recorded: its port is unknown, so the OS never changes it here. */
+typedef struct {
+	u32	magic;
+	u16	version;
+	u16	record_size;
+	u32	clock;		/* CPU cycles per second */
+} PNLHEADER;
+
+typedef struct {
+	u64	cycle;
+	u8	reg;
+	u8	value;
+} ATTRIBUTE_PACKED PNLRECORD;
+
+typedef struct PANEL {
+	FILE*		file;
+	unsigned int	count;
+	PNLRECORD	buffer[PNL_BUFFER];
+} PANEL;
+
+void	PNLOpen(Emulator* ctx, const char* filename);
+void	PNLClose(Emulator* ctx);
+void	PNLRecord(Emulator* ctx, u8 reg, u8 value);
+void	PNLFlush(Emulator* ctx);
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "types.h"
+#include "emulator.h"
+
+/* Preallocated emulator instances for batch jobs. All instances and their RAM
+ * live in one mapping (optionally backed by huge pages), the ROM is loaded
+ * once. POOLAcquire hands out an instance in power-on state; only the RAM
+ * pages dirtied by the previous job are cleared. The inserted floppy is kept,
+ * tracks written by the previous job included. Like EMUReset, POOLAcquire does
+ * not touch the CPU: power and reset the Z80 before running the instance. */
+typedef struct {
+	unsigned int	count;
+	unsigned int	free_count;
+	unsigned int*	free_list;
+
+	Emulator*	instances;
+	u8*		ram;
+
+	size_t		size;
+	BOOL		huge;
+} POOL;
+
+POOL*		POOLCreate(unsigned int count, const char* rom_file, BOOL huge);
+void		POOLDelete(POOL* pool);
+Emulator*	POOLAcquire(POOL* pool, Z80* z80);
+void		POOLRelease(POOL* pool, Emulator* ctx);
+
+#endif
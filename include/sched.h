@@ -0,0 +1,41 @@
+#ifndef __SCHED_H__
+#define __SCHED_H__
+
+#include "types.h"
+
+#define	SCHED_NEVER		(~(u64) 0)
+
+/* event sources */
+#define	EVT_CTC0		0
+#define	EVT_CTC1		1
+#define	EVT_CTC2		2
+#define	EVT_CTC3		3
+#define	EVT_DMA			4
+#define	EVT_FDD_INDEX		5
+#define	EVT_FDD_INDEX_END	6
+#define	EVT_INPUT		7
+#define	EVT_SIOB_RX		8
+#define	EVT_SIOB_TX		9
+#define	EVT_VOICE		10
+#define	EVT_SHM			11
+#define	EVT_COUNT		12
+
+/* Called with the cycle the event was scheduled for; the handler may
+ * reschedule its own event. */
+typedef void (*SCHEDHANDLER)(void* context, unsigned int id, u64 deadline);
+
+/* Cycle stamped one-shot events, one slot per source. next caches the
+ * earliest deadline so that the per-step check is a single compare. The
+ * handler table (one entry per source) is shared by all instances. */
+typedef struct {
+	u64		next;
+	u64		deadline[EVT_COUNT];
+	const SCHEDHANDLER* handler;
+} SCHED;
+
+void	SCHEDInit(SCHED* sched, const SCHEDHANDLER* handler);
+void	SCHEDSet(SCHED* sched, unsigned int id, u64 deadline);
+void	SCHEDCancel(SCHED* sched, unsigned int id);
+void	SCHEDRun(SCHED* sched, void* context, u64 now);
+
+#endif
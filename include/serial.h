@@ -0,0 +1,32 @@
+#ifndef __SERIAL_H__
+#define __SERIAL_H__
+
+#include "types.h"
+#include "emulator.h"
+
+#define	SER_BUFFER_SIZE		4096
+#define	SER_POLL_CYCLES		(CPU_CLOCK / 1000)	/* idle receive poll: 1ms */
+#define	SER_FLUSH_CYCLES	(CPU_CLOCK / 1000)	/* transmit flush after 1ms idle */
+
+/* Host side of the SIO channel B bridge. Both directions are buffered so
+ * that the host file descriptor is only touched once per buffer (or once
+ * per poll interval while idle), never per emulated byte or instruction. */
+typedef struct SERIAL {
+	int	fd;
+	char	name[256];
+
+	u8	rx[SER_BUFFER_SIZE];
+	u32	rx_head;
+	u32	rx_tail;
+
+	u8	tx[SER_BUFFER_SIZE];
+	u32	tx_count;
+} SERIAL;
+
+void	SERAttach(Emulator* ctx, const char* spec);
+void	SERDetach(Emulator* ctx);
+BOOL	SERReceive(Emulator* ctx, u8* data);
+void	SERTransmit(Emulator* ctx, u8 data);
+void	SERFlush(Emulator* ctx);
+
+#endif
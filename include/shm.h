@@ -0,0 +1,55 @@
+#ifndef __SHM_H__
+#define __SHM_H__
+
+#include "types.h"
+#include "emulator.h"
+
+#define	SHM_MAGIC		0x4D485345	/* "ESHM" */
+#define	SHM_VERSION		1
+#define	SHM_RAM_OFFSET		4096
+#define	SHM_INTERVAL		(CPU_CLOCK / 1000)	/* header refresh: 1ms */
+
+/* Layout of the POSIX shared memory object: this header in the first page,
+ * the live emulator RAM at SHM_RAM_OFFSET. The header is refreshed every
+ * SHM_INTERVAL emulated cycles; seq is odd while an update is in progress,
+ * readers retry if it is odd or changed while they were copying. */
+typedef struct SHMHEADER {
+	u32	magic;
+	u32	version;
+	vu32	seq;
+	u32	ram_offset;
+	u32	ram_size;
+	u32	pad;
+
+	u64	cycle;
+
+	u16	pc;
+	u16	sp;
+	u16	af;
+	u16	bc;
+	u16	de;
+	u16	hl;
+	u16	ix;
+	u16	iy;
+	u16	af_;
+	u16	bc_;
+	u16	de_;
+	u16	hl_;
+	u8	i;
+	u8	r;
+	u8	iff;
+	u8	im;
+
+	u8	led_reg[3];
+	u8	channel_cfg_h[8];
+	u8	channel_cfg_l[8];
+
+	u16	dma_addr[5][4];
+	u16	dma_wc[5][4];
+} SHMHEADER;
+
+void	SHMAttach(Emulator* ctx, const char* name);
+void	SHMDetach(Emulator* ctx);
+void	SHMUpdate(Emulator* ctx);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stddef.h>
+
+#include "types.h"
+#include "emulator.h"
+
+#define	SNAP_MAGIC		0x504E5345	/* "ESNP" */
+#define	SNAP_VERSION		4
+
+/* Machine state at one point in time. The file stores the fields one by
+ * one in the order below, little endian and without padding, followed by
+ * the RAM. The CTC channels hold the counter value the CPU would read;
+ * their timer bookkeeping and the DMA transfer schedule are not stored. */
+typedef struct {
+	u32		magic;
+	u32		version;
+
+	u64		cycle;
+
+	ZZ80State	cpu;
+
+	u8		cpua16;
+	u8		forc16;
+	u8		kbdmux;
+
+	u64		keyboard;
+	u8		keyboard2;
+
+	u8		channel_cfg_h[8];
+	u8		channel_cfg_l[8];
+	u8		led_reg[3];
+
+	u8		fdd_track;
+	u16		fdd_state;
+
+	Z80SIO		sio;
+	Z80PIO		pio;
+	Z80CTC		ctc;
+	DMA		dma[5];
+	DAISY		daisy;
+
+	u8		ram[EMU_RAM_SIZE] ATTRIBUTE_ALGIN(64);
+} SNAPSHOT;
+
+typedef struct {
+	u32		start;
+	u32		len;
+} SNAPRANGE;
+
+void		SNAPTake(SNAPSHOT* snap, Emulator* ctx);
+BOOL		SNAPSave(const SNAPSHOT* snap, const char* filename);
+BOOL		SNAPLoad(SNAPSHOT* snap, const char* filename);
+
+unsigned int	SNAPDiffRAM(const u8* a, const u8* b, size_t len, SNAPRANGE* ranges, unsigned int max);
+unsigned int	SNAPDiff(const SNAPSHOT* a, const SNAPSHOT* b);
+const char*	SNAPRegion(u32 addr);
+
+#endif
@@ -46,6 +46,7 @@ typedef int		bool;
 #endif
 
 #define	ATTRIBUTE_ALGIN(x)	__attribute__((aligned(x)))
+#define	ATTRIBUTE_PACKED	__attribute__((packed))
 
 #if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
 #define U16B(x)		(x)
@@ -0,0 +1,68 @@
+#ifndef __VOICE_H__
+#define __VOICE_H__
+
+#include <stdio.h>
+
+#include "types.h"
+#include "emulator.h"
+
+#define	VOC_COUNT		8
+#define	VOC_CLOCK		11550000	/* channel timer clock */
+#define	VOC_RATE		44100		/* output sample rate */
+#define	VOC_BLOCK		256		/* frames rendered at once */
+#define	VOC_SYNC_CYCLES		(CPU_CLOCK / 100)	/* render at least every 10ms */
+#define	VOC_RAMP		64		/* gate fade in/out frames */
+
+/* One sample voice: the channel timer requests a byte from the DMA start
+ * channel on every underflow, once its count is exhausted the loop channel
+ * is replayed over and over. The DAC holds the last byte. */
+typedef struct {
+	u8	running;	/* ~RSTCHn released */
+	u8	loop;		/* playing the loop segment */
+	u8	dec;		/* address decrement */
+	u8	sample;		/* DAC input */
+
+	u16	addr;		/* next byte */
+	u32	left;		/* bytes left in the segment */
+
+	u64	phase;		/* 32.32 source position */
+	u64	step;		/* source samples per output frame, 32.32 */
+
+	f32	gain;		/* VCA, follows GATEn */
+	f32	target;
+	u32	ramp;		/* frames left to reach the target */
+
+	f32	coeff;		/* VCF, one pole low pass, 1: open */
+	f32	y;
+} VOICE;
+
+/* Voices are rendered in blocks whenever a CHnCS or DMA register is about
+ * to change and every VOC_SYNC_CYCLES, into a mono 16 bit WAV file. Gate
+ * and filter settings thus only change at block boundaries. Within a block
+ * each voice is a row of float samples, the rows are summed by the mixer
+ * kernel (see mixer.h). */
+typedef struct VOICES {
+	FILE*	file;
+	u32	data_size;
+
+	u64	frames;		/* frames written */
+	u64	base;		/* frame at the last reset */
+
+	VOICE	voice[VOC_COUNT];
+
+	f32	pcm[VOC_COUNT][VOC_BLOCK] ATTRIBUTE_ALGIN(32);
+	f32	gain[VOC_COUNT];
+	f32	step_gain[VOC_COUNT];
+
+	u8	dac[VOC_BLOCK];	/* DAC input of one voice */
+	s16	out[VOC_BLOCK];
+} VOICES;
+
+void	VOCOpen(Emulator* ctx, const char* filename);
+void	VOCClose(Emulator* ctx);
+void	VOCReset(Emulator* ctx);
+void	VOCUpdate(Emulator* ctx, unsigned int ch);
+void	VOCRender(Emulator* ctx);
+void	VOCFlush(Emulator* ctx);
+
+#endif
@@ -92,6 +92,15 @@ typedef struct {
 
 	void (* halt)(void *context, BOOL state);
 
+	/** Callback: Called when the CPU executes a RETI instruction.
+	  * @details Z80 family peripherals decode RETI on the bus to end the
+	  * service of their interrupt.
+	  * @param context The value of the member @c context.
+	  * @note This callback is optional and must be set to @c NULL if not
+	  * used. */
+
+	void (* reti)(void *context);
+
 	/** CPU registers and internal bits.
 	  * @details It contains the state of the registers, as well as the
 	  * interrupt flip-flops, variables related to interrupts and other
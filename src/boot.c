@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "types.h"
+#include "boot.h"
+
+/* High level emulation of the boot ROM (both the retail and the wildcard
+ * EPROM behave identically): instead of seeking to track 0, waiting for the
+ * index pulse and reading the first OS track byte by byte, the machine is
+ * put into the state in which the ROM jumps to the OS. */
+
+typedef struct {
+	u8	port;
+	u8	data;
+} BOOTOUT;
+
+typedef struct {
+	u16	addr;
+	u8	len;
+	u8	data[11];
+} BOOTRAM;
+
+/* The device programming of the ROM, in order, without the writes which
+ * only drive the seek (PIO B step pulses, CTC delays) or start the DMA. */
+static const BOOTOUT boot_out[] = {
+	/* LEDs, DMA command registers, keyboard, CTC vector */
+	{ 0xC0, 0x00 }, { 0x70, 0x00 }, { 0xC1, 0x00 }, { 0x78, 0xA0 },
+	{ 0x08, 0xE0 }, { 0x18, 0xE0 }, { 0x28, 0xE0 }, { 0x38, 0xE0 },
+	{ 0xC3, 0x29 }, { 0x7B, 0xC0 }, { 0x7A, 0xC0 }, { 0x40, 0xF0 },
+
+	/* SIO B: vector, status affects vector */
+	{ 0x63, 0x02 }, { 0x63, 0xE0 }, { 0x63, 0x01 }, { 0x63, 0x04 },
+
+	/* PIO B: control mode, floppy lines */
+	{ 0x53, 0xCF }, { 0x53, 0x04 }, { 0x52, 0x01 },
+
+	/* SIO A: channel reset, sync mode for the floppy, motor on, EXI */
+	{ 0x61, 0x18 }, { 0x61, 0x04 }, { 0x61, 0x10 }, { 0x61, 0x06 },
+	{ 0x61, 0xFA }, { 0x61, 0x07 }, { 0x61, 0x96 }, { 0x61, 0x05 },
+	{ 0x61, 0xE4 }, { 0x61, 0x03 }, { 0x61, 0xC0 }, { 0x61, 0x01 },
+	{ 0x61, 0x01 },
+
+	/* DMA 0 channel 0: track header to 040C, then the track to 0500 */
+	{ 0x40, 0xC7 }, { 0x40, 0x01 }, { 0x0A, 0x04 }, { 0x0A, 0x05 },
+	{ 0x81, 0x00 }, { 0x52, 0xC3 }, { 0x0B, 0x44 }, { 0x0C, 0x44 },
+	{ 0x00, 0x0C }, { 0x00, 0x04 }, { 0x01, 0x03 }, { 0x01, 0x00 },
+	{ 0x00, 0x00 }, { 0x00, 0x05 }, { 0x01, 0xFF }, { 0x01, 0x0D },
+
+	/* after the transfer: stop the CTC, receiver off, floppy lines */
+	{ 0x61, 0x01 }, { 0x40, 0x03 }, { 0x61, 0x05 }, { 0x61, 0xE4 },
+	{ 0x61, 0x03 }, { 0x61, 0xC0 }, { 0x61, 0x01 }, { 0x61, 0x01 },
+	{ 0x52, 0x03 }
+};
+
+/* ROM variables, IM 2 vectors and the stack as the ROM leaves them. The
+ * return address on top of the stack is the ROM's wait loop. */
+static const BOOTRAM boot_ram[] = {
+	{ 0x0404, 8, { 0xFF, 0x0A, 0x03, 0xFF, 0xBD, 0x05, 0x56, 0x02 } },
+	{ 0x0410, 11, { 0x00, 0x0B, 0x00, 0x05, 0x00, 0x0E, 0x00, 0x05, 0xC0, 0x00, 0x80 } },
+	{ 0x04D6, 10, { 0x91, 0x03, 0x10, 0x04, 0x10, 0xB0, 0x00, 0x05, 0xBE, 0x00 } },
+	{ 0x04EA, 2, { 0x2F, 0x02 } },
+	{ 0x04F0, 2, { 0x27, 0x03 } },
+	{ 0xFFFD, 2, { 0x10, 0x04 } }
+};
+
+static void BOOTWrite(Emulator* ctx, u32 addr, const u8* data, unsigned int len)
+{
+	memcpy(ctx->ram + addr, data, len);
+	for(u32 page = addr / EMU_PAGE_SIZE; page <= (addr + len - 1) / EMU_PAGE_SIZE; page++) {
+		ctx->dirty |= _BV(page);
+	}
+}
+
+/* Loads the floppy tracks where the ROM and the OS put them: the OS at
+ * 0500, the banks at 02000 and 12000 (see FLOPPY.md). Later tracks win
+ * where they overlap. */
+static void BOOTLoadTracks(Emulator* ctx, unsigned int first, unsigned int count, u32 addr)
+{
+	for(unsigned int i = 0; i < count; i++) {
+		BOOTWrite(ctx, addr + i * FDD_TRACK_SIZE, EMUGetTrack(ctx, first + i), FDD_TRACK_SIZE);
+	}
+}
+
+/* Puts the machine into the state of the ROM's jump to the OS at
+ * BOOT_ENTRY, at cycle 0. If pc is a different address, the remaining OS
+ * track and both banks are loaded as well and execution starts at pc; the
+ * devices are left as the ROM programmed them. Call after z80_reset. */
+void BOOTLoad(Emulator* ctx, u16 pc)
+{
+	Z80* z80 = ctx->z80;
+
+	for(unsigned int i = 0; i < sizeof(boot_out) / sizeof(*boot_out); i++) {
+		z80out(ctx, boot_out[i].port, boot_out[i].data);
+	}
+
+	/* DMA 0 channel 0 reached terminal count and masked itself */
+	DMACH* ch = &ctx->dma[0].channel[0];
+	ch->addr += ch->wc;
+	ch->wc = 0;
+	ch->mask = 1;
+
+	/* the whole first track was read */
+	ctx->fdd.track = 0;
+	ctx->fdd.state = 5 + FDD_TRACK_SIZE;
+
+	for(unsigned int i = 0; i < sizeof(boot_ram) / sizeof(*boot_ram); i++) {
+		BOOTWrite(ctx, boot_ram[i].addr, boot_ram[i].data, boot_ram[i].len);
+	}
+
+	BOOTLoadTracks(ctx, 0, 1, BOOT_ENTRY);
+	if(pc != BOOT_ENTRY) {
+		BOOTLoadTracks(ctx, 1, 1, BOOT_ENTRY + FDD_TRACK_SIZE);
+		BOOTLoadTracks(ctx, 2, 16, 0x02000);
+		BOOTLoadTracks(ctx, 18, 16, 0x12000);
+	}
+
+	z80->state.pc = pc;
+	z80->state.sp = 0x04DE;
+	z80->state.af.value_uint16 = 0xB010;
+	z80->state.bc.value_uint16 = 0x0161;
+	z80->state.de.value_uint16 = 0x0405;
+	z80->state.hl.value_uint16 = 0x0192;
+	z80->state.ix.value_uint16 = 0xFFFF;
+	z80->state.iy.value_uint16 = 0x0410;
+	z80->state.i = 0x04;
+	z80->state.r = 0x35;
+	z80->state.internal.im = 2;
+	z80->state.internal.iff1 = 1;
+	z80->state.internal.iff2 = 1;
+
+	printf("HLE boot: OS entry at %04X\n", pc);
+}
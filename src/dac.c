@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "dac.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define	DAC_X86
+#include <immintrin.h>
+#endif
+
+#define	DAC_SCALE	(1.0f / 32768.0f)
+
+typedef void (*DACKERNEL16)(s16* out, const u8* in, size_t count);
+typedef void (*DACKERNELF)(f32* out, const u8* in, size_t count);
+
+static s16 table16[256];
+static f32 tablef[256];
+
+static const char* kernel_name = "table";
+static DACKERNEL16 kernel16;
+static DACKERNELF kernelf;
+
+s16 DACReference(u8 val)
+{
+	int sign = val & 0x80;
+	int c = (val >> 4) & 0x07;
+	int s = val & 0x0F;
+	int v = (1 << c) * (2 * s + 33) - 33;
+	return (s16) ((sign ? -v : v) * 4);
+}
+
+static void DACDecodeTable(s16* out, const u8* in, size_t count)
+{
+	for(size_t i = 0; i < count; i++) {
+		out[i] = table16[in[i]];
+	}
+}
+
+static void DACDecodeTableFloat(f32* out, const u8* in, size_t count)
+{
+	for(size_t i = 0; i < count; i++) {
+		out[i] = tablef[in[i]];
+	}
+}
+
+#ifdef DAC_X86
+/* 8 bytes zero extended to 16 bit lanes. The exponent 1 << c is built from
+ * its three bits as (1 + 1 * c0) * (1 + 3 * c1) * (1 + 15 * c2). */
+__attribute__((target("sse2")))
+static inline __m128i DACDecode8SSE2(__m128i v)
+{
+	const __m128i one = _mm_set1_epi16(1);
+
+	__m128i c0 = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(0x10)), _mm_set1_epi16(0x10)), _mm_set1_epi16(1));
+	__m128i c1 = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(0x20)), _mm_set1_epi16(0x20)), _mm_set1_epi16(3));
+	__m128i c2 = _mm_and_si128(_mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(0x40)), _mm_set1_epi16(0x40)), _mm_set1_epi16(15));
+	__m128i pow = _mm_mullo_epi16(_mm_add_epi16(c0, one), _mm_add_epi16(c1, one));
+	pow = _mm_mullo_epi16(pow, _mm_add_epi16(c2, one));
+
+	__m128i s = _mm_and_si128(v, _mm_set1_epi16(0x0F));
+	__m128i mag = _mm_add_epi16(_mm_add_epi16(s, s), _mm_set1_epi16(33));
+	mag = _mm_sub_epi16(_mm_mullo_epi16(mag, pow), _mm_set1_epi16(33));
+	mag = _mm_slli_epi16(mag, 2);
+
+	__m128i sign = _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16(0x80)), _mm_set1_epi16(0x80));
+	return _mm_sub_epi16(_mm_xor_si128(mag, sign), sign);
+}
+
+__attribute__((target("sse2")))
+static void DACDecodeSSE2(s16* out, const u8* in, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (in + i));
+		_mm_storeu_si128((__m128i*) (out + i), DACDecode8SSE2(_mm_unpacklo_epi8(v, zero)));
+		_mm_storeu_si128((__m128i*) (out + i + 8), DACDecode8SSE2(_mm_unpackhi_epi8(v, zero)));
+	}
+
+	DACDecodeTable(out + i, in + i, count - i);
+}
+
+__attribute__((target("sse2")))
+static void DACDecodeFloatSSE2(f32* out, const u8* in, size_t count)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 scale = _mm_set1_ps(DAC_SCALE);
+
+	size_t i = 0;
+	for(; i + 8 <= count; i += 8) {
+		__m128i v = _mm_loadl_epi64((const __m128i*) (in + i));
+		__m128i d = DACDecode8SSE2(_mm_unpacklo_epi8(v, zero));
+
+		/* sign extend to 32 bit */
+		__m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(d, d), 16);
+		__m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(d, d), 16);
+		_mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+		_mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+	}
+
+	DACDecodeTableFloat(out + i, in + i, count - i);
+}
+
+/* 16 bytes zero extended to 16 bit lanes, the exponent is looked up with
+ * a byte shuffle (the high byte of each lane selects zero). */
+__attribute__((target("avx2")))
+static inline __m256i DACDecode16AVX2(__m256i v)
+{
+	const __m256i pow_lut = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+		1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+
+	__m256i c = _mm256_and_si256(_mm256_srli_epi16(v, 4), _mm256_set1_epi16(0x07));
+	__m256i pow = _mm256_shuffle_epi8(pow_lut, _mm256_or_si256(c, _mm256_set1_epi16((short) 0x8000)));
+
+	__m256i s = _mm256_and_si256(v, _mm256_set1_epi16(0x0F));
+	__m256i mag = _mm256_add_epi16(_mm256_add_epi16(s, s), _mm256_set1_epi16(33));
+	mag = _mm256_sub_epi16(_mm256_mullo_epi16(mag, pow), _mm256_set1_epi16(33));
+	mag = _mm256_slli_epi16(mag, 2);
+
+	__m256i sign = _mm256_srai_epi16(_mm256_slli_epi16(v, 8), 15);
+	return _mm256_sub_epi16(_mm256_xor_si256(mag, sign), sign);
+}
+
+__attribute__((target("avx2")))
+static void DACDecodeAVX2(s16* out, const u8* in, size_t count)
+{
+	size_t i = 0;
+	for(; i + 32 <= count; i += 32) {
+		__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (in + i)));
+		__m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (in + i + 16)));
+		_mm256_storeu_si256((__m256i*) (out + i), DACDecode16AVX2(a));
+		_mm256_storeu_si256((__m256i*) (out + i + 16), DACDecode16AVX2(b));
+	}
+
+	DACDecodeTable(out + i, in + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void DACDecodeFloatAVX2(f32* out, const u8* in, size_t count)
+{
+	const __m256 scale = _mm256_set1_ps(DAC_SCALE);
+
+	size_t i = 0;
+	for(; i + 16 <= count; i += 16) {
+		__m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*) (in + i)));
+		__m256i d = DACDecode16AVX2(v);
+
+		__m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(d));
+		__m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(d, 1));
+		_mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+		_mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+	}
+
+	DACDecodeTableFloat(out + i, in + i, count - i);
+}
+#endif
+
+static void DACTables(void)
+{
+	for(unsigned int i = 0; i < 256; i++) {
+		table16[i] = DACReference(i);
+		tablef[i] = table16[i] * DAC_SCALE;
+	}
+}
+
+BOOL DACSelect(const char* name)
+{
+	DACTables();
+
+	if(!strcmp(name, "table")) {
+		kernel_name = "table";
+		kernel16 = DACDecodeTable;
+		kernelf = DACDecodeTableFloat;
+		return TRUE;
+	}
+
+#ifdef DAC_X86
+	__builtin_cpu_init();
+	if(!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+		kernel_name = "avx2";
+		kernel16 = DACDecodeAVX2;
+		kernelf = DACDecodeFloatAVX2;
+		return TRUE;
+	}
+	if(!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+		kernel_name = "sse2";
+		kernel16 = DACDecodeSSE2;
+		kernelf = DACDecodeFloatSSE2;
+		return TRUE;
+	}
+#endif
+
+	return FALSE;
+}
+
+void DACInit(void)
+{
+	if(kernel16) {
+		return;
+	}
+
+	if(!DACSelect("avx2") && !DACSelect("sse2")) {
+		DACSelect("table");
+	}
+}
+
+const char* DACKernel(void)
+{
+	return kernel_name;
+}
+
+void DACDecode(s16* out, const u8* in, size_t count)
+{
+	kernel16(out, in, count);
+}
+
+void DACDecodeFloat(f32* out, const u8* in, size_t count)
+{
+	kernelf(out, in, count);
+}
@@ -1,12 +1,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include <errno.h>
 #include <math.h>
 
 #include "types.h"
 #include "emulator.h"
 #include "trace.h"
+#include "image.h"
+#include "shm.h"
+#include "serial.h"
+#include "panel.h"
+#include "voice.h"
+#include "fdz.h"
 
 /*
  * MEMORY MAP:
@@ -202,8 +209,9 @@
 /* #define DEBUG_DMA_TRANSFER */
 /* #define DEBUG_LEDS */
 /* #define DEBUG_KBD */
-#define DEBUG_CH
-#define DEBUG_CHCONFIG
+/* #define DEBUG_INPUT */
+/* #define DEBUG_CH */
+/* #define DEBUG_CHCONFIG */
 /* #define DEBUG_IO */
 
 static inline u8 EMUDescrambleData(u8 data)
@@ -232,10 +240,136 @@ static inline u16 EMUScrambleAddr(u16 addr)
 		| ((addr & 512) >> 2);	/* 9 */
 }
 
+static void EMUInitPorts(Emulator* ctx);
+static void EMUEventCTC(void* context, unsigned int id, u64 deadline);
+static void EMUEventDMA(void* context, unsigned int id, u64 deadline);
+static void EMUUpdateDMA(Emulator* ctx, unsigned int dmacs, unsigned int i, BOOL restart);
+static void EMUScheduleDMA(Emulator* ctx);
+static void EMUEventFDD(void* context, unsigned int id, u64 deadline);
+static void EMUEjectFloppy(Emulator* ctx);
+static void EMUEventInput(void* context, unsigned int id, u64 deadline);
+static void EMUEventSIO(void* context, unsigned int id, u64 deadline);
+static void EMUScheduleSIO(Emulator* ctx);
+static void EMUEventVoice(void* context, unsigned int id, u64 deadline);
+static void EMUEventSHM(void* context, unsigned int id, u64 deadline);
+static void EMUPortWriteKBD(Emulator* ctx, u8 unit, u8 reg, u8 data);
+static u8 EMUPortReadKBD(Emulator* ctx, u8 unit, u8 reg);
+
 void EMUInit(Emulator* ctx, Z80* z80, const char* rom_file)
 {
+	EMUInitRAM(ctx, z80, rom_file, NULL);
+}
+
+void EMUInitRAM(Emulator* ctx, Z80* z80, const char* rom_file, u8* ram)
+{
+	memset(ctx, 0, sizeof(Emulator));
+	ctx->z80 = z80;
+
+	/* the descrambled ROM is shared by all instances using the same file */
+	ctx->rom_image = IMGFind(rom_file, 1024);
+	if(!ctx->rom_image) {
+		u8 eprom[1024];
+		FILE* rom = fopen(rom_file, "rb");
+		if(!rom) {
+			printf("Error opening EPROM %s: %s\n", rom_file, strerror(errno));
+			exit(1);
+		}
+
+		fread(eprom, 1024, 1, rom);
+		fclose(rom);
+
+		ctx->rom_image = IMGCreate(rom_file, 1024);
+
+		for(int i = 0; i < 1024; i++) {
+			u16 addr = EMUScrambleAddr(i);
+			if(addr < 1024)
+				ctx->rom_image->data[i] = EMUDescrambleData(eprom[addr]);
+			else
+				printf("FAIL: %04X => %04X\n", i, addr);
+		}
+	}
+
+	ctx->rom = ctx->rom_image->data;
+	printf("EPROM serial: %02X%02X\n", ctx->rom[0x60], ctx->rom[0x5F]);
+
+	if(ram) {
+		/* externally owned (e.g. pool), must be zeroed */
+		ctx->ram = ram;
+	} else {
+		if(posix_memalign((void**) &ctx->ram, EMU_PAGE_SIZE, EMU_RAM_SIZE)) {
+			printf("Error allocating RAM: out of memory\n");
+			exit(1);
+		}
+		memset(ctx->ram, 0, EMU_RAM_SIZE);
+		ctx->own_ram = 1;
+	}
+
+	EMUInitPorts(ctx);
+	EMUReset(ctx);
+}
+
+static const SCHEDHANDLER handlers[EVT_COUNT] = {
+	[EVT_CTC0] = EMUEventCTC,
+	[EVT_CTC1] = EMUEventCTC,
+	[EVT_CTC2] = EMUEventCTC,
+	[EVT_CTC3] = EMUEventCTC,
+	[EVT_DMA] = EMUEventDMA,
+	[EVT_FDD_INDEX] = EMUEventFDD,
+	[EVT_FDD_INDEX_END] = EMUEventFDD,
+	[EVT_INPUT] = EMUEventInput,
+	[EVT_SIOB_RX] = EMUEventSIO,
+	[EVT_SIOB_TX] = EMUEventSIO,
+	[EVT_VOICE] = EMUEventVoice,
+	[EVT_SHM] = EMUEventSHM
+};
+
+/* back to the power-on state of the devices and RAM, keeping the ROM, the
+ * floppy and the attached host interfaces. The Z80 is not part of the
+ * instance: the caller has to z80_power/z80_reset it as well. */
+void EMUReset(Emulator* ctx)
+{
+	/* clear only the RAM pages which were written since the last reset */
+	u32 dirty = ctx->dirty;
+	while(dirty) {
+		unsigned int page = __builtin_ctz(dirty);
+		dirty &= dirty - 1;
+		memset(ctx->ram + page * EMU_PAGE_SIZE, 0, EMU_PAGE_SIZE);
+	}
+
+	Z80* z80 = ctx->z80;
+	u8* rom = ctx->rom;
+	u8* ram = ctx->ram;
+	u8 own_ram = ctx->own_ram;
+	EMUPORTS* ports = ctx->ports;
+	IMAGE* rom_image = ctx->rom_image;
+	FDDDISK disk = ctx->disk;
+	struct SHMHEADER* shm = ctx->shm;
+	const char* shm_name = ctx->shm_name;
+	struct SERIAL* serial = ctx->serial;
+	struct PANEL* panel = ctx->panel;
+	struct VOICES* voices = ctx->voices;
+	u8 turbo_dma = ctx->turbo_dma;
+	u8 fast_disk = ctx->fast_disk;
+	INPUT* input = ctx->input;
+	u16 idle_entry = ctx->idle.entry;
+
 	memset(ctx, 0, sizeof(Emulator));
+
 	ctx->z80 = z80;
+	ctx->rom = rom;
+	ctx->ram = ram;
+	ctx->own_ram = own_ram;
+	ctx->ports = ports;
+	ctx->rom_image = rom_image;
+	ctx->disk = disk;
+	ctx->shm = shm;
+	ctx->shm_name = shm_name;
+	ctx->serial = serial;
+	ctx->panel = panel;
+	ctx->voices = voices;
+	ctx->turbo_dma = turbo_dma;
+	ctx->fast_disk = fast_disk;
+	ctx->idle.entry = idle_entry;
 
 	ctx->led_reg[0] = 0xFF;
 	ctx->led_reg[1] = 0xFF;
@@ -245,31 +379,17 @@ void EMUInit(Emulator* ctx, Z80* z80, const char* rom_file)
 	ctx->last_leds[2] = 0xFF;
 	ctx->forc16 = 0;
 
-	u8* eprom = (u8*) malloc(1024);
-	FILE* rom = fopen(rom_file, "rb");
-	if(!rom) {
-		printf("Error opening EPROM %s: %s\n", rom_file, strerror(errno));
-		exit(1);
+	/* initialize events */
+	SCHEDInit(&ctx->sched, handlers);
+	if(shm) {
+		SCHEDSet(&ctx->sched, EVT_SHM, 0);
 	}
 
-	fread(eprom, 1024, 1, rom);
-	fclose(rom);
-
-	memset(ctx->rom, 0, 1024);
-
-	for(int i = 0; i < 1024; i++) {
-		u16 addr = EMUScrambleAddr(i);
-		if(addr < 1024)
-			ctx->rom[i] = EMUDescrambleData(eprom[addr]);
-		else
-			printf("FAIL: %04X => %04X\n", i, addr);
+	/* replay the input timeline from the start */
+	if(input) {
+		input->next = 0;
 	}
-
-	free(eprom);
-
-	printf("EPROM serial: %02X%02X\n", ctx->rom[0x60], ctx->rom[0x5F]);
-
-	memset(ctx->ram, 0, 128 * 1024);
+	EMUSetInput(ctx, input);
 
 	/* initialize PIO */
 	ctx->pio.state = PIO_STATE_NORMAL;
@@ -285,7 +405,10 @@ void EMUInit(Emulator* ctx, Z80* z80, const char* rom_file)
 		}
 	}
 
-	ctx->fdd.data = (u8*) malloc(FDD_SIZE);
+	/* silence all voices */
+	if(voices) {
+		VOCReset(ctx);
+	}
 
 #if 0
 	/* report RELEASE and ACCESSORY from sequencer board */
@@ -293,20 +416,152 @@ void EMUInit(Emulator* ctx, Z80* z80, const char* rom_file)
 #endif
 }
 
+void EMUDestroy(Emulator* ctx)
+{
+	SHMDetach(ctx);
+	SERDetach(ctx);
+	PNLClose(ctx);
+	VOCClose(ctx);
+
+	EMUEjectFloppy(ctx);
+	IMGRelease(ctx->rom_image);
+
+	ctx->rom_image = NULL;
+	ctx->rom = NULL;
+
+	if(ctx->own_ram) {
+		free(ctx->ram);
+	}
+	ctx->ram = NULL;
+
+	free(ctx->ports);
+	ctx->ports = NULL;
+}
+
+Emulator* EMUCreate(Z80* z80, const char* rom_file)
+{
+	Emulator* ctx;
+	if(posix_memalign((void**) &ctx, EMU_CACHE_LINE, sizeof(Emulator))) {
+		printf("Error allocating emulator: out of memory\n");
+		exit(1);
+	}
+
+	EMUInit(ctx, z80, rom_file);
+
+	return ctx;
+}
+
+void EMUDelete(Emulator* ctx)
+{
+	EMUDestroy(ctx);
+	free(ctx);
+}
+
+static void EMUEjectFloppy(Emulator* ctx)
+{
+	FDDDISK* disk = &ctx->disk;
+
+	for(unsigned int track = 0; track < FDD_TRACKS; track++) {
+		IMGRelease(disk->tracks[track]);
+		disk->tracks[track] = NULL;
+	}
+	IMGRelease(disk->source);
+	IMGRelease(disk->image);
+
+	disk->source = NULL;
+	disk->packed = 0;
+	disk->image = NULL;
+	disk->data = NULL;
+	disk->dirty = 0;
+	disk->flushed = 0;
+}
+
 void EMULoadFloppy(Emulator* ctx, const char* filename)
 {
 	printf("Loading floppy image from %s...\n", filename);
 
-	FILE* fdd = fopen(filename, "rb");
-	if(!fdd) {
-		perror("fopen");
-		exit(1);
+	IMAGE* source;
+	u8 packed = 0;
+
+	u32 packed_size = FDZProbe(filename);
+	if(packed_size) {
+		/* compressed container: tracks are decoded on first access */
+		source = IMGMap(filename, packed_size);
+		if(!FDZCheck(source->data, source->size, FDD_TRACKS, FDD_TRACK_SIZE)) {
+			printf("Invalid floppy container %s\n", filename);
+			exit(1);
+		}
+		packed = 1;
+	} else {
+		source = IMGMap(filename, FDD_SIZE);
+	}
+
+	EMUEjectFloppy(ctx);
+	ctx->disk.source = source;
+	ctx->disk.packed = packed;
+
+	u8* track0 = EMUGetTrack(ctx, 0);
+	printf("Floppy serial: %02X%02X\n", track0[4], track0[3]);
+}
+
+/* Until the floppy is patched or written, tracks come from the process wide
+ * table of interned track data, so identical tracks of different floppies
+ * (e.g. the OS) exist only once. A track of an image file refers to the
+ * mapped file, which is only paged in as far as tracks are accessed. */
+u8* EMUGetTrack(Emulator* ctx, unsigned int track)
+{
+	static u8 no_track[FDD_TRACK_SIZE];
+	FDDDISK* disk = &ctx->disk;
+
+	if(track >= FDD_TRACKS) {
+		return no_track;
+	}
+	if(disk->data) {
+		return disk->data + track * FDD_TRACK_SIZE;
+	}
+
+	if(!disk->tracks[track]) {
+		if(disk->packed) {
+			u8 data[FDD_TRACK_SIZE];
+			FDZDecode(disk->source->data, track, data, FDD_TRACK_SIZE);
+			disk->tracks[track] = IMGInternData(data, FDD_TRACK_SIZE);
+		} else {
+			disk->tracks[track] = IMGInternView(disk->source, track * FDD_TRACK_SIZE, FDD_TRACK_SIZE);
+		}
+#ifdef DEBUG_FDD
+		printf("FDD LOAD: TRK=%02d\n", track);
+#endif
 	}
 
-	fread(ctx->fdd.data, FDD_SIZE, 1, fdd);
-	fclose(fdd);
+	return disk->tracks[track]->data;
+}
+
+u8* EMUPatchFloppy(Emulator* ctx)
+{
+	FDDDISK* disk = &ctx->disk;
+
+	if(!disk->data) {
+		IMAGE* image;
+		if(disk->packed) {
+			image = IMGCreate(NULL, FDD_SIZE);
+			for(unsigned int track = 0; track < FDD_TRACKS; track++) {
+				memcpy(image->data + track * FDD_TRACK_SIZE, EMUGetTrack(ctx, track), FDD_TRACK_SIZE);
+			}
+		} else {
+			/* copy on write: other instances keep seeing the original image */
+			image = IMGUnshare(IMGRetain(disk->source));
+		}
+
+		for(unsigned int track = 0; track < FDD_TRACKS; track++) {
+			IMGRelease(disk->tracks[track]);
+			disk->tracks[track] = NULL;
+		}
+
+		disk->image = image;
+		disk->data = image->data;
+	}
 
-	printf("Floppy serial: %02X%02X\n", ctx->fdd.data[4], ctx->fdd.data[3]);
+	return disk->data;
 }
 
 void EMUPressKey(Emulator* ctx, u8 keyid)
@@ -336,6 +591,42 @@ u8 EMUKeyboardToKey(u8 midi)
 	}
 }
 
+/* Delivers all key transitions due at this cycle and schedules the next
+ * one. */
+static void EMUEventInput(void* context, unsigned int id, u64 deadline)
+{
+	Emulator* ctx = (Emulator*) context;
+	INPUT* input = ctx->input;
+
+	while(input->next < input->count && input->events[input->next].cycle <= deadline) {
+		INPEVENT* evt = &input->events[input->next++];
+#ifdef DEBUG_INPUT
+		printf("%s KEY %u\n", evt->press ? "PRESSING" : "RELEASING", evt->key);
+#endif
+		if(evt->press) {
+			EMUPressKey(ctx, evt->key);
+		} else {
+			EMUReleaseKey(ctx, evt->key);
+		}
+	}
+
+	if(input->next < input->count) {
+		SCHEDSet(&ctx->sched, EVT_INPUT, input->events[input->next].cycle);
+	}
+}
+
+/* (Re)attaches an input timeline, delivery continues at input->next. Call
+ * it again after adding events. */
+void EMUSetInput(Emulator* ctx, INPUT* input)
+{
+	ctx->input = input;
+	SCHEDCancel(&ctx->sched, EVT_INPUT);
+
+	if(input && input->next < input->count) {
+		SCHEDSet(&ctx->sched, EVT_INPUT, input->events[input->next].cycle);
+	}
+}
+
 u16 EMUGetLEDs(Emulator* ctx)
 {
 	u16 led_ic112 = 0;
@@ -460,8 +751,52 @@ void EMUUpdateState(Emulator* ctx)
 		ctx->last_leds[0] = ctx->led_reg[0];
 		ctx->last_leds[1] = ctx->led_reg[1];
 		ctx->last_leds[2] = ctx->led_reg[2];
-		EMUUpdateLEDs(ctx);
+
+		/* the panel stream replaces the text output */
+		if(!ctx->panel) {
+			EMUUpdateLEDs(ctx);
+		}
+	}
+}
+
+/* Interrupt daisy chain: sources are ordered by priority (lowest bit
+ * first). INT is asserted while a pending source has a higher priority than
+ * all sources in service; acknowledging moves the source in service and
+ * RETI ends service of the highest priority one. */
+static void EMUUpdateIRQ(Emulator* ctx)
+{
+	DAISY* daisy = &ctx->daisy;
+
+	BOOL state = FALSE;
+	if(daisy->pending) {
+		u8 first = daisy->pending & -daisy->pending;
+		u8 service = daisy->service & -daisy->service;
+		state = !service || first < service;
+	}
+
+	z80_int(ctx->z80, state);
+}
+
+void EMURaiseIRQ(Emulator* ctx, unsigned int source, u8 vector)
+{
+	DAISY* daisy = &ctx->daisy;
+
+	daisy->pending |= _BV(source);
+	daisy->vector[source] = vector;
+	EMUUpdateIRQ(ctx);
+}
+
+/* Earliest cycle at which the machine can change without the CPU doing
+ * anything: now if INT is asserted, otherwise the next scheduled event.
+ * Not every event raises an interrupt (DMA, voices), so this is only a
+ * lower bound for the next interrupt. */
+u64 EMUNextEvent(Emulator* ctx)
+{
+	if(ctx->z80->state.internal.irq) {
+		return ctx->cycle;
 	}
+
+	return ctx->sched.next;
 }
 
 u8 EMUReceiveFDD(Emulator* ctx)
@@ -490,7 +825,7 @@ u8 EMUReceiveFDD(Emulator* ctx)
 			if(off < FDD_TRACK_SIZE) {
 				/* track data */
 				fdd->state++;
-				u8* trackdata = fdd->data + fdd->track * FDD_TRACK_SIZE;
+				u8* trackdata = EMUGetTrack(ctx, fdd->track);
 				return trackdata[off];
 			} else if(off + 2 < FDD_TRACK_SIZE) {
 				/* CRC-16 */
@@ -504,6 +839,38 @@ u8 EMUReceiveFDD(Emulator* ctx)
 	}
 }
 
+/* Counterpart of EMUReceiveFDD with the same track framing: only the track
+ * data bytes are stored, the header, gap and CRC bytes are dropped. The
+ * first change to a track unshares the image and marks the track dirty. */
+void EMUTransmitFDD(Emulator* ctx, u8 data)
+{
+	FDD* fdd = &ctx->fdd;
+#if defined(DEBUG_FDD) || defined(DEBUG_FDD_WRITE)
+	printf("FDD TX: STATE=%X DATA=%02X\n", fdd->state, data);
+#endif
+
+	if(fdd->state < 5) {
+		fdd->state++;
+		return;
+	}
+
+	u16 off = fdd->state - 5;
+	if(off < FDD_TRACK_SIZE && fdd->track < FDD_TRACKS) {
+		u64 bit = (u64) 1 << fdd->track;
+		if(EMUGetTrack(ctx, fdd->track)[off] != data) {
+			if(!(ctx->disk.dirty & bit)) {
+				EMUPatchFloppy(ctx);
+				ctx->disk.dirty |= bit;
+			}
+			ctx->disk.data[fdd->track * FDD_TRACK_SIZE + off] = data;
+		}
+		fdd->state++;
+	} else if(off + 2 < FDD_TRACK_SIZE) {
+		/* CRC-16 */
+		fdd->state++;
+	}
+}
+
 void EMUStepFDDHead(Emulator* ctx, unsigned int dir)
 {
 	FDD* fdd = &ctx->fdd;
@@ -712,16 +1079,32 @@ u8 EMUReadSIO(Emulator* ctx, BOOL ab, BOOL cd)
 
 		switch(ch->ptrlatch) {
 			case 0:
-				if(!ch->rxne && ch->rx_enable) {
-					/* read from floppy */
-					ch->rx_data = EMUReceiveFDD(ctx);
-					ch->rxne = 1;
+				if(ab) {
+					/* channel B: filled by EMUEventSIO */
+				} else if(!ch->rxne && ch->rx_enable) {
+					if(ctx->cycle < ch->rx_ready && ctx->fast_disk) {
+						/* the poll loop would spin until the byte
+						 * arrives, but must not run past an event */
+						u64 until = ch->rx_ready < ctx->sched.next ? ch->rx_ready : ctx->sched.next;
+						if(until > ctx->cycle) {
+							EMUSkip(ctx, until - ctx->cycle);
+						}
+					}
+
+					if(ctx->cycle >= ch->rx_ready) {
+						/* read from floppy */
+						ch->rx_data = EMUReceiveFDD(ctx);
+						ch->rxne = 1;
+					}
 				}
 
 				result = 0;
 				if(ch->rxne) {
 					result |= _BV(0);
 				}
+				if(ab && !ch->tx_busy) {
+					result |= _BV(2);
+				}
 				if(ch->last_dcd) {
 					result |= _BV(3);
 				}
@@ -739,6 +1122,13 @@ u8 EMUReadSIO(Emulator* ctx, BOOL ab, BOOL cd)
 		SIOCH* ch = ab ? &sio->channel_b : &sio->channel_a;
 		ch->rxne = 0;
 		result = ch->rx_data;
+
+		/* the next byte arrives one byte time later */
+		if(ab) {
+			EMUScheduleSIO(ctx);
+		} else {
+			ch->rx_ready = ctx->cycle + FDD_BYTE_CYCLES;
+		}
 	}
 
 #ifdef DEBUG_SIO
@@ -783,8 +1173,15 @@ void EMUWriteSIO(Emulator* ctx, BOOL ab, BOOL cd, u8 data)
 						ch->exi_pending = 0;
 						break;
 					case 3: /* channel reset */
+						if(ab) {
+							ch->rx_enable = 0;
+							ch->rxne = 0;
+							ch->tx_busy = 0;
+							SCHEDCancel(&ctx->sched, EVT_SIOB_RX);
+						}
 						break;
 					case 4: /* enable int on next rx char */
+						ch->rx_first = 1;
 						break;
 					case 5: /* reset tx int pending */
 						break;
@@ -809,6 +1206,7 @@ void EMUWriteSIO(Emulator* ctx, BOOL ab, BOOL cd, u8 data)
 					sio->status_affects_vector = data & _BV(2);
 				}
 				ch->rx_int_mode = (data >> 3) & 0x03;
+				ch->rx_first = 1;
 #ifdef DEBUG_SIO
 				printf(":: SIO %c WR1: EXI_EN=%X TX_INT_EN=%X STATUS_AFFECTS_VECTOR=%X RX_INT_MODE=%X [%s]\n", c, !!ch->exi_enable, !!ch->tx_int_enable, !!sio->status_affects_vector, ch->rx_int_mode, RX_INT_MODE[ch->rx_int_mode]);
 #endif
@@ -828,6 +1226,11 @@ void EMUWriteSIO(Emulator* ctx, BOOL ab, BOOL cd, u8 data)
 #ifdef DEBUG_SIO
 				printf(":: SIO %c WR3: RX=%X\n", c, !!ch->rx_enable);
 #endif
+				if(ab) {
+					EMUScheduleSIO(ctx);
+				} else if(ch->rx_enable) {
+					ch->rx_ready = ctx->cycle + FDD_BYTE_CYCLES;
+				}
 				break;
 			case 4:
 				ch->ptrlatch = 0;
@@ -839,6 +1242,10 @@ void EMUWriteSIO(Emulator* ctx, BOOL ab, BOOL cd, u8 data)
 #ifdef DEBUG_SIO
 				printf(":: SIO %c WR5: RTS=%X DTR=%X\n", c, !!ch->rts, !!ch->dtr);
 #endif
+				if(!ab) {
+					/* DTR A drives the floppy motor */
+					EMUSetFDDMotor(ctx, ch->dtr);
+				}
 				break;
 			case 6:
 				ch->ptrlatch = 0;
@@ -857,7 +1264,31 @@ void EMUWriteSIO(Emulator* ctx, BOOL ab, BOOL cd, u8 data)
 		}
 	} else {
 		/* DATA */
+		if(!ab) {
+			/* channel A: FDD */
+			EMUTransmitFDD(ctx, data);
+		} else {
+			/* channel B: host bridge */
+			SERTransmit(ctx, data);
+			sio->channel_b.tx_busy = 1;
+			SCHEDSet(&ctx->sched, EVT_SIOB_TX, ctx->cycle + SIO_BYTE_CYCLES);
+		}
+	}
+}
+
+static void EMUSIOIRQ(Emulator* ctx, BOOL ab, u8 bits)
+{
+	Z80SIO* sio = &ctx->sio;
+
+	u8 vector = sio->vector;
+	if(sio->status_affects_vector) {
+		vector = (sio->vector & 0xF1) | (bits << 1);
 	}
+
+#ifdef DEBUG_SIO
+	printf("SIO SENDING IRQ: %02X\n", vector);
+#endif
+	EMURaiseIRQ(ctx, ab ? IRQ_SIO_B : IRQ_SIO_A, vector);
 }
 
 void EMUSIOEXI(Emulator* ctx, BOOL ab, BOOL cts, BOOL dcd)
@@ -873,17 +1304,7 @@ void EMUSIOEXI(Emulator* ctx, BOOL ab, BOOL cts, BOOL dcd)
 		ch->last_dcd = dcd;
 
 		if(ch->exi_enable) {
-			if(sio->status_affects_vector) {
-				u8 bits = ab ? SIO_IRQVEC_EXI_B : SIO_IRQVEC_EXI_A;
-				ctx->irq = (sio->vector & 0xF1) | (bits << 1);
-			} else {
-				ctx->irq = sio->vector;
-			}
-
-#ifdef DEBUG_SIO
-			printf("SIO SENDING IRQ: %02X\n", ctx->irq);
-#endif
-			z80_int(ctx->z80, TRUE);
+			EMUSIOIRQ(ctx, ab, ab ? SIO_IRQVEC_EXI_B : SIO_IRQVEC_EXI_A);
 		}
 	}
 }
@@ -892,15 +1313,147 @@ void EMUReceiveSIO(Emulator* ctx, BOOL ab, u8 data)
 {
 	Z80SIO* sio = &ctx->sio;
 	SIOCH* ch = ab ? &sio->channel_b : &sio->channel_a;
-	if(ab) {
-		/* channel B: ignore for now */
+
+	ch->rx_data = data;
+	ch->rxne = 1;
+
+	/* channel A (FDD) is only ever polled */
+	if(ab && (ch->rx_int_mode >= 2 || (ch->rx_int_mode == 1 && ch->rx_first))) {
+		ch->rx_first = 0;
+		EMUSIOIRQ(ctx, ab, SIO_IRQVEC_RXNE_B);
+	}
+}
+
+/* Channel B receives one character per SIO_BYTE_CYCLES while the receiver
+ * is enabled and the last character was read. While the host has nothing
+ * to send, the bridge is polled every SER_POLL_CYCLES. */
+static void EMUScheduleSIO(Emulator* ctx)
+{
+	SIOCH* ch = &ctx->sio.channel_b;
+
+	if(ctx->serial && ch->rx_enable && !ch->rxne) {
+		SCHEDSet(&ctx->sched, EVT_SIOB_RX, ctx->cycle + SIO_BYTE_CYCLES);
+	} else {
+		SCHEDCancel(&ctx->sched, EVT_SIOB_RX);
+	}
+}
+
+static void EMUEventSIO(void* context, unsigned int id, u64 deadline)
+{
+	Emulator* ctx = (Emulator*) context;
+	SIOCH* ch = &ctx->sio.channel_b;
+
+	if(id == EVT_SIOB_RX) {
+		u8 data;
+		if(!ch->rx_enable || ch->rxne) {
+			return;
+		}
+		if(SERReceive(ctx, &data)) {
+			EMUReceiveSIO(ctx, TRUE, data);
+		} else {
+			SCHEDSet(&ctx->sched, EVT_SIOB_RX, deadline + SER_POLL_CYCLES);
+		}
+	} else if(ch->tx_busy) {
+		/* character sent, the host sees it once the OS pauses sending */
+		ch->tx_busy = 0;
+		if(ch->tx_int_enable) {
+			EMUSIOIRQ(ctx, TRUE, SIO_IRQVEC_TXE_B);
+		}
+		if(ctx->serial) {
+			SCHEDSet(&ctx->sched, EVT_SIOB_TX, deadline + SER_FLUSH_CYCLES);
+		}
+	} else {
+		SERFlush(ctx);
+	}
+}
+
+
+static inline BOOL EMUCTCTimerActive(CTCCH* ch)
+{
+	return !ch->reset && !ch->trigger && !ch->mode && ch->time_constant;
+}
+
+static inline u64 EMUCTCPeriod(CTCCH* ch)
+{
+	return ch->time_constant * (ch->prescaler ? 256 : 16) * 2;
+}
+
+/* Fold the cycles since the last sync into the channel's cycle counter. The
+ * cycles of the instruction in flight belong to the state after the write,
+ * which is why ctx->cycle (start of the instruction) is the sync point. */
+static void EMUSyncCTC(Emulator* ctx, unsigned int channel)
+{
+	CTCCH* ch = &ctx->ctc.channel[channel];
+
+	if(EMUCTCTimerActive(ch)) {
+		ch->cycle_counter += ctx->cycle - ch->sync;
+	}
+	ch->sync = ctx->cycle;
+}
+
+static void EMUInterruptCTC(Emulator* ctx, unsigned int channel)
+{
+	u8 vector = (ctx->ctc.vector & 0xF1) | (channel << 1);
+#ifdef DEBUG_CTC
+	printf("CTC SENDING IRQ: %02X\n", vector);
+#endif
+	EMURaiseIRQ(ctx, IRQ_CTC0 + channel, vector);
+}
+
+/* Compute the cycle at which the timer reaches zero next. A timer which is
+ * already overdue fires at the end of the current step. */
+static void EMUScheduleCTC(Emulator* ctx, unsigned int channel)
+{
+	CTCCH* ch = &ctx->ctc.channel[channel];
+
+	if(EMUCTCTimerActive(ch)) {
+		u64 limit = EMUCTCPeriod(ch);
+		u64 left = ch->cycle_counter < limit ? limit - ch->cycle_counter : 0;
+		SCHEDSet(&ctx->sched, EVT_CTC0 + channel, ch->sync + left);
 	} else {
-		/* channel A: FDD */
-		ch->rx_data = data;
-		ch->rxne = 1;
+		SCHEDCancel(&ctx->sched, EVT_CTC0 + channel);
+	}
+}
+
+static void EMUEventCTC(void* context, unsigned int id, u64 deadline)
+{
+	Emulator* ctx = (Emulator*) context;
+	Z80CTC* ctc = &ctx->ctc;
+	unsigned int i = id - EVT_CTC0;
+	CTCCH* ch = &ctc->channel[i];
+
+	EMUSyncCTC(ctx, i);
+	ch->cycle_counter -= EMUCTCPeriod(ch);
+
+	/* IRQ */
+	if(ch->interrupt) {
+		EMUInterruptCTC(ctx, i);
+	}
+
+	/* at most one zero crossing per step */
+	EMUScheduleCTC(ctx, i);
+	if(ctx->sched.deadline[id] <= ctx->cycle) {
+		SCHEDSet(&ctx->sched, id, ctx->cycle + 1);
 	}
 }
 
+u8 EMUReadCTC(Emulator* ctx, unsigned int channel)
+{
+	CTCCH* ch = &ctx->ctc.channel[channel];
+	u8 result = ch->counter;
+
+	if(EMUCTCTimerActive(ch)) {
+		/* down counter value derived from the elapsed cycles */
+		u64 elapsed = ch->cycle_counter + ctx->cycle - ch->sync;
+		u64 ticks = elapsed / ((ch->prescaler ? 256 : 16) * 2);
+		result = ticks < ch->time_constant ? ch->time_constant - ticks : 1;
+	}
+
+#ifdef DEBUG_CTC
+	printf("CTC READ: %X = %02X\n", channel, result);
+#endif
+	return result;
+}
 
 void EMUWriteCTC(Emulator* ctx, unsigned int channel, u8 data)
 {
@@ -910,6 +1463,8 @@ void EMUWriteCTC(Emulator* ctx, unsigned int channel, u8 data)
 	printf("CTC WRITE: %X = %02X\n", channel, data);
 #endif
 
+	EMUSyncCTC(ctx, channel);
+
 	if(ctc->latch) {
 		ch->time_constant = data;
 		ch->counter = data;
@@ -937,54 +1492,8 @@ void EMUWriteCTC(Emulator* ctx, unsigned int channel, u8 data)
 		printf(":: CTC %X RESET=%X TRIG=%X [%s] EDGE=%X [%s] PRESCALER=%X [%d] MODE=%X [%s] INT=%X\n", channel, !!ch->reset, !!ch->trigger, ch->trigger ? "PULSE" : "AUTO", !!ch->edge, ch->edge ? "RISING" : "FALLING", !!ch->prescaler, ch->prescaler ? 256 : 16, !!ch->mode, ch->mode ? "COUNTER" : "TIMER", !!ch->interrupt);
 #endif
 	}
-}
-
-void EMUStepCTC(Emulator* ctx)
-{
-	Z80CTC* ctc = &ctx->ctc;
-	u64 dcycles = ctx->z80->cycles;
-
-	for(unsigned int i = 0; i < 4; i++) {
-		CTCCH* ch = &ctc->channel[i];
-		if(ch->reset) {
-			continue;
-		}
-
-		if(!ch->trigger && !ch->mode && ch->time_constant) {
-			/* timer is active */
-			ch->cycle_counter += dcycles;
-
-			u64 limit = ch->time_constant * (ch->prescaler ? 256 : 16) * 2;
-			if(ch->cycle_counter >= limit) {
-				ch->cycle_counter -= limit;
-				/* IRQ */
-
-				if(ch->interrupt) {
-					ctc->pending_irq |= _BV(i);
-				}
-			}
-		}
-	}
 
-	if(ctc->irq_timer) {
-		ctc->irq_timer--;
-		if(!ctc->irq_timer) {
-			z80_int(ctx->z80, FALSE);
-		}
-	} else {
-		for(unsigned int i = 0; i < 4; i++) {
-			if(ctc->pending_irq & _BV(i)) {
-				ctx->irq = (ctc->vector & 0xF1) | (i << 1);
-#ifdef DEBUG_CTC
-				printf("CTC SENDING IRQ: %02X\n", ctx->irq);
-#endif
-				z80_int(ctx->z80, TRUE);
-				ctc->pending_irq &= ~_BV(i);
-				ctc->irq_timer = 2;
-				break;
-			}
-		}
-	}
+	EMUScheduleCTC(ctx, channel);
 }
 
 void EMUTriggerCTC(Emulator* ctx, unsigned int c)
@@ -997,23 +1506,56 @@ void EMUTriggerCTC(Emulator* ctx, unsigned int c)
 		if(!ch->counter) {
 			ch->counter = ch->time_constant;
 			if(ch->interrupt) {
-				ctc->pending_irq |= _BV(c);
+				EMUInterruptCTC(ctx, c);
 			}
 		}
 	}
 }
 
-void EMUWriteDMA(Emulator* ctx, unsigned int dmacs, u8 addr, u8 data)
+/* Advance the clock without executing instructions. Timer zero crossings
+ * which fall into the skipped interval collapse into a single pending
+ * interrupt per channel. */
+void EMUSkip(Emulator* ctx, u64 cycles)
 {
-	unsigned int c = (addr >> 1) & 0x03;
-	DMA* dma = &ctx->dma[dmacs];
-	DMACH* ch = &dma->channel[c];
-#ifdef DEBUG_DMA
-	const char* TRANSFER[4] = { "Verify transfer", "Write transfer", "Read transfer", "Illegal" };
-	const char* MODE[4] = { "Demand", "Single", "Block", "Cascade" };
-#ifdef DEBUG_IGNORE_DMA4
-	if(dmacs != 4) {
-#endif
+	Z80CTC* ctc = &ctx->ctc;
+
+	ctx->cycle += cycles;
+
+	for(unsigned int i = 0; i < 4; i++) {
+		CTCCH* ch = &ctc->channel[i];
+		if(!EMUCTCTimerActive(ch)) {
+			continue;
+		}
+
+		EMUSyncCTC(ctx, i);
+		u64 limit = EMUCTCPeriod(ch);
+		if(ch->cycle_counter >= limit) {
+			ch->cycle_counter %= limit;
+			if(ch->interrupt) {
+				EMUInterruptCTC(ctx, i);
+			}
+		}
+		EMUScheduleCTC(ctx, i);
+	}
+}
+
+void EMUWriteDMA(Emulator* ctx, unsigned int dmacs, u8 addr, u8 data)
+{
+	unsigned int c = (addr >> 1) & 0x03;
+	DMA* dma = &ctx->dma[dmacs];
+	DMACH* ch = &dma->channel[c];
+
+	/* the voices play with the channel setup up to now */
+	if(ctx->voices && dmacs < 4) {
+		VOCRender(ctx);
+	}
+
+#ifdef DEBUG_DMA
+	const char* TRANSFER[4] = { "Verify transfer", "Write transfer", "Read transfer", "Illegal" };
+	const char* MODE[4] = { "Demand", "Single", "Block", "Cascade" };
+#ifdef DEBUG_IGNORE_DMA4
+	if(dmacs != 4) {
+#endif
 	printf("DMA %X WRITE: %X = %02X\n", dmacs, addr, data);
 #ifdef DEBUG_IGNORE_DMA4
 	}
@@ -1094,9 +1636,8 @@ void EMUWriteDMA(Emulator* ctx, unsigned int dmacs, u8 addr, u8 data)
 			c = data & 3;
 			ch = &dma->channel[c];
 			ch->mask = data & _BV(2);
-			if(!ch->mask) {
-				ch->timer = 0;
-			}
+			EMUUpdateDMA(ctx, dmacs, c, !ch->mask);
+			EMUScheduleDMA(ctx);
 #ifdef DEBUG_DMA
 #ifdef DEBUG_IGNORE_DMA4
 			if(dmacs == 4) {
@@ -1113,6 +1654,8 @@ void EMUWriteDMA(Emulator* ctx, unsigned int dmacs, u8 addr, u8 data)
 			ch->autoinit = data & _BV(4);
 			ch->addr_dec = data & _BV(5);
 			ch->mode = data >> 6;
+			EMUUpdateDMA(ctx, dmacs, c, FALSE);
+			EMUScheduleDMA(ctx);
 #ifdef DEBUG_DMA
 #ifdef DEBUG_IGNORE_DMA4
 			if(dmacs == 4) {
@@ -1139,7 +1682,9 @@ void EMUWriteDMA(Emulator* ctx, unsigned int dmacs, u8 addr, u8 data)
 			memset(dma, 0, sizeof(DMA));
 			for(unsigned int i = 0; i < 4; i++) {
 				dma->channel[i].mask = 1;
+				EMUUpdateDMA(ctx, dmacs, i, FALSE);
 			}
+			EMUScheduleDMA(ctx);
 #ifdef DEBUG_DMA
 #ifdef DEBUG_IGNORE_DMA4
 			if(dmacs == 4) {
@@ -1152,7 +1697,9 @@ void EMUWriteDMA(Emulator* ctx, unsigned int dmacs, u8 addr, u8 data)
 		case 0xF: /* write all mask register bits */
 			for(unsigned int i = 0; i < 4; i++) {
 				dma->channel[i].mask = data & _BV(i);
+				EMUUpdateDMA(ctx, dmacs, i, FALSE);
 			}
+			EMUScheduleDMA(ctx);
 #ifdef DEBUG_DMA
 #ifdef DEBUG_IGNORE_DMA4
 			if(dmacs == 4) {
@@ -1170,76 +1717,226 @@ void EMUWriteDMA(Emulator* ctx, unsigned int dmacs, u8 addr, u8 data)
 	}
 }
 
-void EMUStepDMA(Emulator* ctx)
+static void EMUTransferDMA(Emulator* ctx, unsigned int dmacs, unsigned int i)
 {
-	for(unsigned int dmacs = 0; dmacs < 5; dmacs++) {
-		DMA* dma = &ctx->dma[dmacs];
+	DMACH* ch = &ctx->dma[dmacs].channel[i];
 
-		for(unsigned int i = 0; i < 4; i++) {
-			DMACH* ch = &dma->channel[i];
-			if(!ch->mask && ch->mode == 1) {
-				if(ch->timer < 100) {
-					ch->timer++;
-				} else {
-					/* perform transfer */
+	/* perform transfer */
 #if defined(DEBUG_DMA) && defined(DEBUG_DMA_TRANSFER)
-					printf("DMA %X CH%X TRANSFER => %04X [WC=%04X]\n", dmacs, i, ch->addr, ch->wc);
+	printf("DMA %X CH%X TRANSFER => %04X [WC=%04X]\n", dmacs, i, ch->addr, ch->wc);
 #endif
 
-					BOOL eop = ch->wc == 0;
-					switch(dmacs << 4 | i) {
-						case 0x00: { /* DMACS=0, CH=0 */
-							u8 data = EMUReceiveFDD(ctx);
+	BOOL eop = ch->wc == 0;
+	switch(dmacs << 4 | i) {
+		case 0x00: { /* DMACS=0, CH=0 */
+			u32 addr = ch->addr;
+			if(dmacs == 0 && i == 0) {
+				u32 chaa16 = (ctx->channel_cfg_h[0] & _BV(4)) ? 0x10000 : 0;
+				addr |= chaa16;
+			}
 
-							u32 addr = ch->addr;
-							if(dmacs == 0 && i == 0) {
-								u32 chaa16 = (ctx->channel_cfg_h[0] & _BV(4)) ? 0x10000 : 0;
-								addr |= chaa16;
-							}
+			if(ch->transfer == 2) {
+				/* read transfer: memory to floppy */
+				u8 data = addr < 1024 ? ctx->rom[addr] : ctx->ram[addr];
+				TRCRead(addr, data);
+				EMUTransmitFDD(ctx, data);
+				break;
+			}
+
+			u8 data = EMUReceiveFDD(ctx);
 
 #if defined(DEBUG_DMA) && defined(DEBUG_DMA_TRANSFER)
-							printf("DMA %X CH%X WR %05X = %02X\n", dmacs, i, addr, data);
+			printf("DMA %X CH%X WR %05X = %02X\n", dmacs, i, addr, data);
 #endif
 
-							TRCWrite(addr, data);
+			TRCWrite(addr, data);
 
-							if(addr < 1024) {
-								/* ignore write */
-							} else {
-								ctx->ram[addr] = data;
-							}
+			if(addr < 1024) {
+				/* ignore write */
+			} else {
+				ctx->ram[addr] = data;
+				ctx->dirty |= _BV(addr / EMU_PAGE_SIZE);
+			}
 
-							break;
-						}
-					}
+			break;
+		}
+	}
 
-					if(eop) {
-						/* EOP */
-						TRON();
+	if(eop) {
+		/* EOP */
+		TRON();
 
-						ch->mask = 1;
+		ch->mask = 1;
+		ctx->dma_active &= ~_BV(dmacs * 4 + i);
 #if defined(DEBUG_DMA) && defined(DEBUG_DMA_TRANSFER)
-						printf("DMA %X CH%X EOP\n", dmacs, i);
+		printf("DMA %X CH%X EOP\n", dmacs, i);
 #endif
 
-						if(dmacs == 0 && i == 0) {
-							EMUTriggerCTC(ctx, 0);
-						}
-					} else {
-						if(ch->addr_dec) {
-							ch->addr--;
-						} else {
-							ch->addr++;
-						}
+		if(dmacs == 0 && i == 0) {
+			EMUTriggerCTC(ctx, 0);
+		}
+	} else {
+		if(ch->addr_dec) {
+			ch->addr--;
+		} else {
+			ch->addr++;
+		}
 
-						ch->wc--;
+		ch->wc--;
 
-						ch->timer = 0;
-					}
-				}
+		ch->next = ctx->cycle + DMA_TRANSFER_CYCLES;
+	}
+}
+
+/* Run the transfers of the floppy channel (DMACS=0, CH=0) which are due
+ * before the next scheduled event at once and advance the clock to the
+ * cycle of the last one. The CPU resumes there, so every event still fires
+ * on its own cycle. The track data span is copied in one go, header and CRC
+ * bytes go through the regular path so that the FDD state ends up exactly
+ * where it would be. */
+static void EMUTurboDMA(Emulator* ctx)
+{
+	DMACH* ch = &ctx->dma[0].channel[0];
+	FDD* fdd = &ctx->fdd;
+
+	/* transfers at cycle + n * DMA_TRANSFER_CYCLES, before the next event
+	 * which can interact with the transfer: the other DMA channels, and the
+	 * CTC and SIO whose interrupts the CPU has to see in time. The index
+	 * pulse, the input timeline and the voice and shm ticks are dispatched
+	 * after the slice with their own deadlines. */
+	u64 next = SCHED_NEVER;
+	for(unsigned int id = EVT_CTC0; id <= EVT_CTC3; id++) {
+		if(ctx->sched.deadline[id] < next) {
+			next = ctx->sched.deadline[id];
+		}
+	}
+	if(ctx->sched.deadline[EVT_SIOB_RX] < next) {
+		next = ctx->sched.deadline[EVT_SIOB_RX];
+	}
+	if(ctx->sched.deadline[EVT_SIOB_TX] < next) {
+		next = ctx->sched.deadline[EVT_SIOB_TX];
+	}
+
+	u32 active = ctx->dma_active & ~_BV(0);
+	while(active) {
+		unsigned int bit = __builtin_ctz(active);
+		active &= active - 1;
+
+		DMACH* other = &ctx->dma[bit / 4].channel[bit % 4];
+		if(other->next < next) {
+			next = other->next;
+		}
+	}
+
+	u64 count = ch->wc + 1;
+	if(next <= ctx->cycle) {
+		count = 1;
+	} else if((next - ctx->cycle - 1) / DMA_TRANSFER_CYCLES + 1 < count) {
+		count = (next - ctx->cycle - 1) / DMA_TRANSFER_CYCLES + 1;
+	}
+
+	u64 done = 0;
+	while(done < count && ch->wc && fdd->state < 5) {
+		EMUTransferDMA(ctx, 0, 0);
+		done++;
+	}
+
+	u32 off = fdd->state - 5;
+	if(done < count && ch->wc && !ch->addr_dec && off < FDD_TRACK_SIZE) {
+		/* the last byte is left to the regular path which raises EOP */
+		u32 n = ch->wc;
+		if(n > FDD_TRACK_SIZE - off) {
+			n = FDD_TRACK_SIZE - off;
+		}
+		if(n > 0x10000 - ch->addr) {
+			n = 0x10000 - ch->addr;
+		}
+		if(n > count - done) {
+			n = count - done;
+		}
+
+		u32 addr = ch->addr | ((ctx->channel_cfg_h[0] & _BV(4)) ? 0x10000 : 0);
+		if(addr >= 1024) {
+			const u8* trackdata = EMUGetTrack(ctx, fdd->track) + off;
+			memcpy(ctx->ram + addr, trackdata, n);
+			for(u32 page = addr / EMU_PAGE_SIZE; page <= (addr + n - 1) / EMU_PAGE_SIZE; page++) {
+				ctx->dirty |= _BV(page);
+			}
+			for(u32 i = 0; i < n; i++) {
+				TRCWrite(addr + i, trackdata[i]);
 			}
+
+			fdd->state += n;
+			ch->addr += n;
+			ch->wc -= n;
+			done += n;
+		}
+	}
+
+	while(done < count && (ctx->dma_active & _BV(0))) {
+		EMUTransferDMA(ctx, 0, 0);
+		done++;
+	}
+
+	EMUSkip(ctx, (done - 1) * DMA_TRANSFER_CYCLES);
+	ch->next = ctx->cycle + DMA_TRANSFER_CYCLES;
+}
+
+static void EMUScheduleDMA(Emulator* ctx)
+{
+	u64 next = SCHED_NEVER;
+
+	u32 active = ctx->dma_active;
+	while(active) {
+		unsigned int bit = __builtin_ctz(active);
+		active &= active - 1;
+
+		DMACH* ch = &ctx->dma[bit / 4].channel[bit % 4];
+		if(ch->next < next) {
+			next = ch->next;
 		}
 	}
+
+	SCHEDSet(&ctx->sched, EVT_DMA, next);
+}
+
+static void EMUEventDMA(void* context, unsigned int id, u64 deadline)
+{
+	Emulator* ctx = (Emulator*) context;
+
+	u32 active = ctx->dma_active;
+	while(active) {
+		unsigned int bit = __builtin_ctz(active);
+		active &= active - 1;
+
+		if(ctx->dma[bit / 4].channel[bit % 4].next <= ctx->cycle) {
+			if(bit == 0 && ctx->turbo_dma && ctx->disk.source && ctx->dma[0].channel[0].transfer != 2) {
+				EMUTurboDMA(ctx);
+			} else {
+				EMUTransferDMA(ctx, bit / 4, bit % 4);
+			}
+		}
+	}
+
+	EMUScheduleDMA(ctx);
+}
+
+/* Track whether a channel performs transfers (unmasked, single mode). A
+ * channel which becomes active, or is unmasked again (restart), transfers
+ * its next byte DMA_TRANSFER_CYCLES from now. */
+static void EMUUpdateDMA(Emulator* ctx, unsigned int dmacs, unsigned int i, BOOL restart)
+{
+	DMACH* ch = &ctx->dma[dmacs].channel[i];
+	u32 bit = _BV(dmacs * 4 + i);
+
+	if(!ch->mask && ch->mode == 1) {
+		if(restart || !(ctx->dma_active & bit)) {
+			ch->next = ctx->cycle + DMA_TRANSFER_CYCLES;
+		}
+		ctx->dma_active |= bit;
+	} else {
+		ctx->dma_active &= ~bit;
+	}
 }
 
 u32 getaddr(Emulator* ctx, u16 addr)
@@ -1289,58 +1986,25 @@ void z80write(void* context, u16 addr, u8 data)
 		/* ignore write */
 	} else {
 		/* TODO: use the CPUA16 bit */
+		if(ctx->idle.armed && ctx->ram[a] != data) {
+			ctx->idle.clean = 0;
+		}
 		ctx->ram[a] = data;
+		ctx->dirty |= _BV(a / EMU_PAGE_SIZE);
 	}
 }
 
 u8 z80in(void* context, u16 addr)
 {
 	Emulator* ctx = (Emulator*) context;
+	EMUIN* port = &ctx->ports->in[addr & 0xFF];
 
-	u8 result = 0;
-
-	switch(addr & 0xFF) {
-		case 0x50:
-			result = EMUReadPIO(ctx, FALSE, FALSE);
-			break;
-		case 0x51:
-			result = EMUReadPIO(ctx, FALSE, TRUE);
-			break;
-		case 0x52:
-			result = EMUReadPIO(ctx, TRUE, FALSE);
-			break;
-		case 0x53:
-			result = EMUReadPIO(ctx, TRUE, TRUE);
-			break;
-		case 0x60:
-			result = EMUReadSIO(ctx, FALSE, FALSE);
-			break;
-		case 0x61:
-			result = EMUReadSIO(ctx, FALSE, TRUE);
-			break;
-		case 0x62:
-			result = EMUReadSIO(ctx, TRUE, FALSE);
-			break;
-		case 0x63:
-			result = EMUReadSIO(ctx, TRUE, TRUE);
-			break;
-		case 0x80: /* KBDICS */
-			if(ctx->kbdmux == 9) { /* which rows? */
-				result = 0xFF; /* all keys ok */
-			} else if(ctx->kbdmux == 8) {
-				result = ctx->keyboard2;
-			} else {
-				result = (u8) (ctx->keyboard >> (ctx->kbdmux * 8));
-			}
-			break;
-		default:
-			result = 0;
-#ifdef DEBUG_IO
-			printf("UNKNOWN IN: %02X = %02X\n", addr & 0xFF, result);
-#endif
-			break;
+	if(ctx->idle.armed && port->handler != EMUPortReadKBD) {
+		ctx->idle.clean = 0;
 	}
 
+	u8 result = port->handler(ctx, port->unit, port->reg);
+
 	TRCIn(addr, result);
 
 	return result;
@@ -1435,251 +2099,236 @@ void EMUPrintCHConfig(Emulator* ctx, unsigned int ch)
 }
 #endif
 
-void z80out(void* context, u16 addr, u8 data)
+static u8 EMUPortReadUnknown(Emulator* ctx, u8 unit, u8 reg)
 {
-	Emulator* ctx = (Emulator*) context;
-
-	TRCOut(addr, data);
-
-	switch(addr & 0xFF) {
-		case 0x40:
-			EMUWriteCTC(ctx, 0, data);
-			break;
-		case 0x41:
-			EMUWriteCTC(ctx, 1, data);
-			break;
-		case 0x42:
-			EMUWriteCTC(ctx, 2, data);
-			break;
-		case 0x43:
-			EMUWriteCTC(ctx, 3, data);
-			break;
-		case 0x50:
-			EMUWritePIO(ctx, FALSE, FALSE, data);
-			break;
-		case 0x51:
-			EMUWritePIO(ctx, FALSE, TRUE, data);
-			break;
-		case 0x52:
-			EMUWritePIO(ctx, TRUE, FALSE, data);
-			break;
-		case 0x53:
-			EMUWritePIO(ctx, TRUE, TRUE, data);
-			break;
-		case 0x60:
-			EMUWriteSIO(ctx, FALSE, FALSE, data);
-			break;
-		case 0x61:
-			EMUWriteSIO(ctx, FALSE, TRUE, data);
-			break;
-		case 0x62:
-			EMUWriteSIO(ctx, TRUE, FALSE, data);
-			break;
-		case 0x63:
-			EMUWriteSIO(ctx, TRUE, TRUE, data);
-			break;
-		case 0x80:
-			/* CH0CSL */
-			ctx->channel_cfg_l[0] = data;
-#ifdef DEBUG_CH
-			printf("CH0CSL = %02X ", data);
-			EMUPrintCH(ctx, 0);
-#endif
-			break;
-		case 0x81:
-			/* CH0CSH */
-			ctx->channel_cfg_h[0] = data;
-#ifdef DEBUG_CH
-			printf("CH0CSH = %02X ", data);
-			EMUPrintCH(ctx, 0);
-#endif
-#ifdef DEBUG_CHCONFIG
-			EMUPrintCHConfig(ctx, 0);
-#endif
-			break;
-		case 0x82:
-			/* CH1CSL */
-			ctx->channel_cfg_l[1] = data;
-#ifdef DEBUG_CH
-			printf("CH1CSL = %02X ", data);
-			EMUPrintCH(ctx, 1);
-#endif
-			break;
-		case 0x83:
-			/* CH1CSH */
-			ctx->channel_cfg_h[1] = data;
-#ifdef DEBUG_CH
-			printf("CH1CSH = %02X ", data);
-			EMUPrintCH(ctx, 1);
-#endif
-#ifdef DEBUG_CHCONFIG
-			EMUPrintCHConfig(ctx, 1);
-#endif
-			break;
-		case 0x84:
-			/* CH2CSL */
-			ctx->channel_cfg_l[2] = data;
-#ifdef DEBUG_CH
-			printf("CH2CSL = %02X ", data);
-			EMUPrintCH(ctx, 2);
-#endif
-			break;
-		case 0x85:
-			/* CH2CSH */
-			ctx->channel_cfg_h[2] = data;
-#ifdef DEBUG_CH
-			printf("CH2CSH = %02X ", data);
-			EMUPrintCH(ctx, 2);
-#endif
-#ifdef DEBUG_CHCONFIG
-			EMUPrintCHConfig(ctx, 2);
-#endif
-			break;
-		case 0x86:
-			/* CH3CSL */
-			ctx->channel_cfg_l[3] = data;
-#ifdef DEBUG_CH
-			printf("CH3CSL = %02X ", data);
-			EMUPrintCH(ctx, 3);
-#endif
-			break;
-		case 0x87:
-			/* CH3CSH */
-			ctx->channel_cfg_h[3] = data;
-#ifdef DEBUG_CH
-			printf("CH3CSH = %02X ", data);
-			EMUPrintCH(ctx, 3);
-#endif
-#ifdef DEBUG_CHCONFIG
-			EMUPrintCHConfig(ctx, 3);
-#endif
-			break;
-		case 0x88:
-			/* CH4CSL */
-			ctx->channel_cfg_l[4] = data;
-#ifdef DEBUG_CH
-			printf("CH4CSL = %02X ", data);
-			EMUPrintCH(ctx, 4);
-#endif
-			break;
-		case 0x89:
-			/* CH4CSH */
-			ctx->channel_cfg_h[4] = data;
-#ifdef DEBUG_CH
-			printf("CH4CSH = %02X ", data);
-			EMUPrintCH(ctx, 4);
-#endif
-#ifdef DEBUG_CHCONFIG
-			EMUPrintCHConfig(ctx, 4);
-#endif
-			break;
-		case 0x8A:
-			/* CH5CSL */
-			ctx->channel_cfg_l[5] = data;
-#ifdef DEBUG_CH
-			printf("CH5CSL = %02X ", data);
-			EMUPrintCH(ctx, 5);
-#endif
-			break;
-		case 0x8B:
-			/* CH5CSH */
-			ctx->channel_cfg_h[5] = data;
-#ifdef DEBUG_CH
-			printf("CH5CSH = %02X ", data);
-			EMUPrintCH(ctx, 5);
-#endif
-#ifdef DEBUG_CHCONFIG
-			EMUPrintCHConfig(ctx, 5);
+#ifdef DEBUG_IO
+	printf("UNKNOWN IN: %02X = %02X\n", unit, 0);
 #endif
-			break;
-		case 0x8C:
-			/* CH6CSL */
-			ctx->channel_cfg_l[6] = data;
-#ifdef DEBUG_CH
-			printf("CH6CSL = %02X ", data);
-			EMUPrintCH(ctx, 6);
+	return 0;
+}
+
+static void EMUPortWriteUnknown(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+#ifdef DEBUG_IO
+	printf("UNKNOWN OUT: %02X = %02X\n", unit, data);
 #endif
-			break;
-		case 0x8D:
-			/* CH6CSH */
-			ctx->channel_cfg_h[6] = data;
+}
+
+static u8 EMUPortReadPIO(Emulator* ctx, u8 unit, u8 reg)
+{
+	return EMUReadPIO(ctx, reg >> 1, reg & 1);
+}
+
+static void EMUPortWritePIO(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+	EMUWritePIO(ctx, reg >> 1, reg & 1, data);
+}
+
+static u8 EMUPortReadSIO(Emulator* ctx, u8 unit, u8 reg)
+{
+	return EMUReadSIO(ctx, reg >> 1, reg & 1);
+}
+
+static void EMUPortWriteSIO(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+	EMUWriteSIO(ctx, reg >> 1, reg & 1, data);
+}
+
+static u8 EMUPortReadCTC(Emulator* ctx, u8 unit, u8 reg)
+{
+	return EMUReadCTC(ctx, reg);
+}
+
+static void EMUPortWriteCTC(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+	EMUWriteCTC(ctx, reg, data);
+}
+
+static void EMUPortWriteDMA(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+	EMUWriteDMA(ctx, unit, reg, data);
+}
+
+static void EMUPortWriteCH(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+	unsigned int ch = reg >> 1;
+
+	if(ctx->voices) {
+		VOCRender(ctx);
+	}
+
+	if(reg & 1) {
+		/* CHnCSH */
+		ctx->channel_cfg_h[ch] = data;
 #ifdef DEBUG_CH
-			printf("CH6CSH = %02X ", data);
-			EMUPrintCH(ctx, 6);
+		printf("CH%uCSH = %02X ", ch, data);
+		EMUPrintCH(ctx, ch);
 #endif
 #ifdef DEBUG_CHCONFIG
-			EMUPrintCHConfig(ctx, 6);
-#endif
-			break;
-		case 0x8E:
-			/* CH7CSL */
-			ctx->channel_cfg_l[7] = data;
-#ifdef DEBUG_CH
-			printf("CH7CSL = %02X ", data);
-			EMUPrintCH(ctx, 7);
+		EMUPrintCHConfig(ctx, ch);
 #endif
-			break;
-		case 0x8F:
-			/* CH7CSH */
-			ctx->channel_cfg_h[7] = data;
+	} else {
+		/* CHnCSL */
+		ctx->channel_cfg_l[ch] = data;
 #ifdef DEBUG_CH
-			printf("CH7CSH = %02X ", data);
-			EMUPrintCH(ctx, 7);
-#endif
-#ifdef DEBUG_CHCONFIG
-			EMUPrintCHConfig(ctx, 7);
-#endif
-			break;
-		case 0xC0: /* LED0CS */
-#ifdef DEBUG_LEDS
-			printf("LED0CS = %02X\n", data);
+		printf("CH%uCSL = %02X ", ch, data);
+		EMUPrintCH(ctx, ch);
 #endif
-			ctx->led_reg[0] = data;
-			EMUUpdateState(ctx);
-			/* EMUUpdateLEDs(ctx); */
-			break;
-		case 0xC1: /* LED1CS */
+	}
+
+	if(ctx->voices) {
+		VOCUpdate(ctx, ch);
+	}
+}
+
+static void EMUEventVoice(void* context, unsigned int id, u64 deadline)
+{
+	Emulator* ctx = (Emulator*) context;
+
+	VOCRender(ctx);
+	SCHEDSet(&ctx->sched, EVT_VOICE, deadline + VOC_SYNC_CYCLES);
+}
+
+static void EMUEventSHM(void* context, unsigned int id, u64 deadline)
+{
+	Emulator* ctx = (Emulator*) context;
+
+	SHMUpdate(ctx);
+	SCHEDSet(&ctx->sched, EVT_SHM, deadline + SHM_INTERVAL);
+}
+
+static void EMUPortWriteLED(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+	/* LED0CS, LED1CS */
 #ifdef DEBUG_LEDS
-			printf("LED1CS = %02X\n", data);
+	printf("LED%uCS = %02X\n", reg, data);
 #endif
-			ctx->led_reg[1] = data;
-			EMUUpdateState(ctx);
-			/* EMUUpdateLEDs(ctx); */
-			break;
-		case 0xC2: /* RELCS */
+	if(ctx->panel && ctx->led_reg[reg] != data) {
+		PNLRecord(ctx, reg, data);
+	}
+	ctx->led_reg[reg] = data;
+	EMUUpdateState(ctx);
+	/* EMUUpdateLEDs(ctx); */
+}
+
+static void EMUPortWriteREL(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+	/* RELCS */
 #ifdef DEBUG_KBD
-			printf("RELCS = %02X\n", data);
+	printf("RELCS = %02X\n", data);
 #endif
-			break;
-		case 0xC3: /* KBDCS */
-			ctx->forc16 = data & _BV(5);
-			ctx->kbdmux = data & 0x0F;
+}
+
+static void EMUPortWriteKBD(Emulator* ctx, u8 unit, u8 reg, u8 data)
+{
+	/* KBDCS */
+	ctx->forc16 = data & _BV(5);
+	ctx->kbdmux = data & 0x0F;
 #ifdef DEBUG_KBD
-			printf("KBDCS = %02X [FORC16=%X KBDMUX=%X]\n", data, !!ctx->forc16, ctx->kbdmux);
+	printf("KBDCS = %02X [FORC16=%X KBDMUX=%X]\n", data, !!ctx->forc16, ctx->kbdmux);
 #endif
-			break;
-		default:
-			if((addr & 0xFF) < 0x40 || (addr & 0xF0) == 0x70) {
-				u8 dmacs = (addr & 0xFF) >> 4;
-				if(dmacs == 7) {
-					dmacs = 4;
-				}
-				EMUWriteDMA(ctx, dmacs, addr & 0x0F, data);
-			} else {
-#ifdef DEBUG_IO
-				printf("UNKNOWN OUT: %02X = %02X\n", addr & 0xFF, data);
-#endif
-			}
-			break;
+}
+
+static u8 EMUPortReadKBD(Emulator* ctx, u8 unit, u8 reg)
+{
+	/* KBDICS */
+	if(ctx->kbdmux == 9) { /* which rows? */
+		return 0xFF; /* all keys ok */
+	} else if(ctx->kbdmux == 8) {
+		return ctx->keyboard2;
+	} else {
+		return (u8) (ctx->keyboard >> (ctx->kbdmux * 8));
+	}
+}
+
+void EMURegisterIn(Emulator* ctx, u8 base, unsigned int count, EMUPORTIN handler, u8 unit)
+{
+	for(unsigned int i = 0; i < count && base + i < 0x100; i++) {
+		EMUIN* port = &ctx->ports->in[base + i];
+		port->handler = handler;
+		port->unit = unit;
+		port->reg = i;
+	}
+}
+
+void EMURegisterOut(Emulator* ctx, u8 base, unsigned int count, EMUPORTOUT handler, u8 unit)
+{
+	for(unsigned int i = 0; i < count && base + i < 0x100; i++) {
+		EMUOUT* port = &ctx->ports->out[base + i];
+		port->handler = handler;
+		port->unit = unit;
+		port->reg = i;
 	}
 }
 
+static void EMUInitPorts(Emulator* ctx)
+{
+	ctx->ports = (EMUPORTS*) malloc(sizeof(EMUPORTS));
+	if(!ctx->ports) {
+		printf("Error allocating port table: out of memory\n");
+		exit(1);
+	}
+
+	/* unknown ports read as 0 and ignore writes, the unit is the port
+	 * address for the DEBUG_IO output */
+	for(unsigned int i = 0; i < 0x100; i++) {
+		EMURegisterIn(ctx, i, 1, EMUPortReadUnknown, i);
+		EMURegisterOut(ctx, i, 1, EMUPortWriteUnknown, i);
+	}
+
+	EMURegisterOut(ctx, 0x00, 16, EMUPortWriteDMA, 0);	/* DMACS0 */
+	EMURegisterOut(ctx, 0x10, 16, EMUPortWriteDMA, 1);	/* DMACS1 */
+	EMURegisterOut(ctx, 0x20, 16, EMUPortWriteDMA, 2);	/* DMACS2 */
+	EMURegisterOut(ctx, 0x30, 16, EMUPortWriteDMA, 3);	/* DMACS3 */
+	EMURegisterOut(ctx, 0x70, 16, EMUPortWriteDMA, 4);	/* DMACS4 */
+
+	EMURegisterIn(ctx, 0x40, 4, EMUPortReadCTC, 0);		/* CTCCS */
+	EMURegisterOut(ctx, 0x40, 4, EMUPortWriteCTC, 0);
+
+	EMURegisterIn(ctx, 0x50, 4, EMUPortReadPIO, 0);		/* PIOCS */
+	EMURegisterOut(ctx, 0x50, 4, EMUPortWritePIO, 0);
+
+	EMURegisterIn(ctx, 0x60, 4, EMUPortReadSIO, 0);		/* SIOCS */
+	EMURegisterOut(ctx, 0x60, 4, EMUPortWriteSIO, 0);
+
+	EMURegisterOut(ctx, 0x80, 16, EMUPortWriteCH, 0);	/* CH0CSL..CH7CSH */
+	EMURegisterIn(ctx, 0x80, 1, EMUPortReadKBD, 0);		/* KBDICS */
+
+	EMURegisterOut(ctx, 0xC0, 2, EMUPortWriteLED, 0);	/* LED0CS, LED1CS */
+	EMURegisterOut(ctx, 0xC2, 1, EMUPortWriteREL, 0);	/* RELCS */
+	EMURegisterOut(ctx, 0xC3, 1, EMUPortWriteKBD, 0);	/* KBDCS */
+}
+
+void z80out(void* context, u16 addr, u8 data)
+{
+	Emulator* ctx = (Emulator*) context;
+	EMUOUT* port = &ctx->ports->out[addr & 0xFF];
+
+	TRCOut(addr, data);
+
+	if(ctx->idle.armed && port->handler != EMUPortWriteKBD) {
+		ctx->idle.clean = 0;
+	}
+
+	port->handler(ctx, port->unit, port->reg, data);
+}
+
 u32 z80int(void* context)
 {
 	Emulator* ctx = (Emulator*) context;
+	DAISY* daisy = &ctx->daisy;
 
-	u8 irq = ctx->irq;
-	ctx->irq = 0;
+	ctx->idle.clean = 0;
+
+	/* acknowledge: the highest priority pending source goes in service */
+	u8 irq = 0;
+	if(daisy->pending) {
+		unsigned int source = __builtin_ctz(daisy->pending);
+		irq = daisy->vector[source];
+		daisy->pending &= ~_BV(source);
+		daisy->service |= _BV(source);
+	}
+	EMUUpdateIRQ(ctx);
 
 #ifdef DEBUG_Z80
 	printf("INT: %02X\n", irq);
@@ -1687,55 +2336,71 @@ u32 z80int(void* context)
 	TRON();
 	TRCIRQ(irq);
 
-	z80_int(ctx->z80, FALSE);
-
 	return irq;
 }
 
+void z80reti(void* context)
+{
+	Emulator* ctx = (Emulator*) context;
+	DAISY* daisy = &ctx->daisy;
+
+	daisy->service &= daisy->service - 1;
+	EMUUpdateIRQ(ctx);
+}
+
 void z80halt(void* context, BOOL state)
 {
 	printf("HALT!\n");
 	exit(0);
 }
 
-void EMUStepFDD(Emulator* ctx)
+/* The index pulse starts once per rotation and ends FDD_INDEX_PULSE
+ * cycles later. Both edges are delivered as SIO channel A DCD changes. */
+static void EMUEventFDD(void* context, unsigned int id, u64 deadline)
 {
-	u64 dcycles = ctx->z80->cycles;
-	FDD* fdd = &ctx->fdd;
-	Z80SIO* sio = &ctx->sio;
-
-	EMUSetFDDMotor(ctx, sio->channel_a.dtr);
+	Emulator* ctx = (Emulator*) context;
 
-	if(fdd->sel_mtr) {
-		if(fdd->rotation > FDD_ROTATION) {
+	if(id == EVT_FDD_INDEX) {
 #if 0
-			printf("FDD: ROTATION [%f]\n", ctx->cycle / (double) CPU_CLOCK);
+		printf("FDD: ROTATION [%f]\n", ctx->cycle / (double) CPU_CLOCK);
 #endif
-			EMUSIOEXI(ctx, FALSE, FALSE, TRUE);
-			fdd->rotation -= FDD_ROTATION;
-			fdd->timer = 100;
-		} else {
-			fdd->rotation += dcycles;
+		EMUSIOEXI(ctx, FALSE, FALSE, TRUE);
+
+		/* pulses which were skipped over are not delivered */
+		u64 next = deadline + FDD_ROTATION;
+		if(next <= ctx->cycle) {
+			next = ctx->cycle + FDD_ROTATION - (ctx->cycle - deadline) % FDD_ROTATION;
 		}
+		SCHEDSet(&ctx->sched, EVT_FDD_INDEX, next);
 
-		if(fdd->timer) {
-			fdd->timer--;
-			if(!fdd->timer) {
+		/* after a turbo slice the pulse may be over already */
+		SCHEDSet(&ctx->sched, EVT_FDD_INDEX_END, deadline + FDD_INDEX_PULSE);
+	} else {
 #if 0
-				printf("FDD: INDEX RESET\n");
+		printf("FDD: INDEX RESET\n");
 #endif
-				EMUSIOEXI(ctx, FALSE, FALSE, FALSE);
-			}
-		}
+		EMUSIOEXI(ctx, FALSE, FALSE, FALSE);
 	}
-
 }
 
 void EMUSetFDDMotor(Emulator* ctx, BOOL sel_mtr)
 {
 	FDD* fdd = &ctx->fdd;
 
+	sel_mtr = !!sel_mtr;
+	if(fdd->sel_mtr == sel_mtr) {
+		return;
+	}
+
 	fdd->sel_mtr = sel_mtr;
+	if(sel_mtr) {
+		SCHEDSet(&ctx->sched, EVT_FDD_INDEX, ctx->cycle + FDD_ROTATION - fdd->rotation);
+	} else {
+		/* remember the disk position until the motor starts again */
+		u64 index = ctx->sched.deadline[EVT_FDD_INDEX];
+		fdd->rotation = index > ctx->cycle ? FDD_ROTATION - (index - ctx->cycle) : 0;
+		SCHEDCancel(&ctx->sched, EVT_FDD_INDEX);
+	}
 }
 
 void EMUSetFDDDirection(Emulator* ctx, BOOL dir)
@@ -1751,10 +2416,121 @@ void EMUSetFDDStep(Emulator* ctx, BOOL step)
 	(void) step;
 }
 
+/* With the motor running, the ROM and OS wait for the index pulse and for
+ * the head to settle in a JR $ loop which is only left through an
+ * interrupt. Nothing can happen before the next event, so the loop
+ * iterations up to the step in which that event fires are accounted for at
+ * once, including the R register increments. */
+static void EMUSkipWait(Emulator* ctx)
+{
+	Z80* z80 = ctx->z80;
+
+	if(!ctx->fdd.sel_mtr || !z80->state.internal.iff1) {
+		return;
+	}
+
+	u64 next = EMUNextEvent(ctx);
+	if(next == SCHED_NEVER || next <= ctx->cycle) {
+		return;
+	}
+
+	u16 pc = z80->state.pc;
+	u32 a = getaddr(ctx, pc);
+	u32 b = getaddr(ctx, pc + 1);
+	u8 op0 = a < 1024 ? ctx->rom[a] : ctx->ram[a];
+	u8 op1 = b < 1024 ? ctx->rom[b] : ctx->ram[b];
+	if(op0 != 0x18 || op1 != 0xFE) {
+		return;
+	}
+
+	/* the event fires in the step in which the clock passes it */
+	u64 iterations = (next - ctx->cycle + 11) / 12;
+	if(iterations > 1) {
+		iterations--;
+		ctx->cycle += iterations * 12;
+		z80->state.r = (z80->state.r & 0x80) | ((z80->state.r + iterations) & 0x7F);
+	}
+}
+
+static BOOL EMUIdleSameCPU(const ZZ80State* a, const ZZ80State* b)
+{
+	/* R counts the instructions, it is the only register a repeating pass
+	 * may change */
+	return !memcmp(a, b, offsetof(ZZ80State, r))
+		&& a->i == b->i
+		&& a->memptr == b->memptr
+		&& !memcmp(&a->internal, &b->internal, sizeof(a->internal));
+}
+
+/* Called whenever execution arrives at the idle entry: if the pass which
+ * just ended is repeatable, the identical passes up to the one in which the
+ * next event fires are accounted for at once. Then the next pass is
+ * recorded. */
+static void EMUIdlePass(Emulator* ctx)
+{
+	IDLE* idle = &ctx->idle;
+	IDLEPASS* pass = &ctx->idle_pass;
+	ZZ80State* cpu = &ctx->z80->state;
+
+	if(idle->armed && idle->clean
+		&& EMUIdleSameCPU(cpu, &pass->cpu)
+		&& pass->keyboard == ctx->keyboard
+		&& pass->keyboard2 == ctx->keyboard2
+		&& pass->kbdmux == ctx->kbdmux
+		&& pass->forc16 == ctx->forc16
+		&& pass->cpua16 == ctx->cpua16) {
+		u64 length = ctx->cycle - idle->start;
+
+		u64 limit = ctx->sched.next;
+		/* nothing is skipped while a deadline is overdue, otherwise the
+		 * event must fire in the pass which is executed next */
+		u64 passes = 0;
+		if(limit > ctx->cycle) {
+			if(limit - ctx->cycle > IDLE_MAX_CYCLES) {
+				limit = ctx->cycle + IDLE_MAX_CYCLES;
+			}
+			passes = (limit - 1 - ctx->cycle) / length;
+		}
+		if(passes) {
+			u8 r = cpu->r - pass->cpu.r;
+			ctx->cycle += passes * length;
+			cpu->r = (cpu->r & 0x80) | ((cpu->r + passes * r) & 0x7F);
+			pass->passes += passes;
+		}
+	}
+
+	idle->armed = 1;
+	idle->clean = 1;
+	idle->start = ctx->cycle;
+	pass->cpu = *cpu;
+	pass->keyboard = ctx->keyboard;
+	pass->keyboard2 = ctx->keyboard2;
+	pass->kbdmux = ctx->kbdmux;
+	pass->forc16 = ctx->forc16;
+	pass->cpua16 = ctx->cpua16;
+}
+
+void EMUSetIdleEntry(Emulator* ctx, u16 pc)
+{
+	ctx->idle.entry = pc;
+	ctx->idle.armed = 0;
+}
+
 void EMUStep(Emulator* ctx)
 {
 	ctx->cycle += ctx->z80->cycles;
-	EMUStepFDD(ctx);
-	EMUStepCTC(ctx);
-	EMUStepDMA(ctx);
+
+	if(ctx->sched.next <= ctx->cycle) {
+		ctx->idle.clean = 0;
+		SCHEDRun(&ctx->sched, ctx, ctx->cycle);
+	}
+
+	if(ctx->fast_disk) {
+		EMUSkipWait(ctx);
+	}
+
+	if(ctx->idle.entry && ctx->z80->state.pc == ctx->idle.entry) {
+		EMUIdlePass(ctx);
+	}
+
 }
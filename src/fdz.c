@@ -0,0 +1,334 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "types.h"
+#include "fdz.h"
+
+#define	FDZ_MIN_MATCH		3
+#define	FDZ_MAX_MATCH		(0x7F + FDZ_MIN_MATCH)
+#define	FDZ_MAX_LITERAL		0x80
+#define	FDZ_HASH_BITS		12
+
+static inline u16 FDZGet16(const u8* p)
+{
+	u16 v;
+	memcpy(&v, p, sizeof(v));
+	return U16L(v);
+}
+
+static inline u32 FDZGet32(const u8* p)
+{
+	u32 v;
+	memcpy(&v, p, sizeof(v));
+	return U32L(v);
+}
+
+static inline void FDZPut16(u8* p, u16 v)
+{
+	v = U16L(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static inline void FDZPut32(u8* p, u32 v)
+{
+	v = U32L(v);
+	memcpy(p, &v, sizeof(v));
+}
+
+static void FDZReadHeader(const u8* data, FDZHEADER* hdr)
+{
+	hdr->magic = FDZGet32(data + 0);
+	hdr->version = FDZGet16(data + 4);
+	hdr->tracks = FDZGet16(data + 6);
+	hdr->track_size = FDZGet32(data + 8);
+}
+
+static void FDZReadTrack(const u8* data, unsigned int track, FDZTRACK* t)
+{
+	const u8* p = data + FDZ_HEADER_SIZE + track * FDZ_INDEX_SIZE;
+	t->offset = FDZGet32(p + 0);
+	t->length = FDZGet16(p + 4);
+	t->method = p[6];
+}
+
+u32 FDZProbe(const char* filename)
+{
+	FILE* f = fopen(filename, "rb");
+	if(!f) {
+		return 0;
+	}
+
+	u8 magic[4];
+	long size = 0;
+	if(fread(magic, sizeof(magic), 1, f) == 1 && FDZGet32(magic) == FDZ_MAGIC) {
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+	}
+	fclose(f);
+
+	return size > 0 ? size : 0;
+}
+
+BOOL FDZCheck(const u8* data, u32 size, unsigned int tracks, unsigned int track_size)
+{
+	FDZHEADER hdr;
+
+	if(size < FDZ_HEADER_SIZE) {
+		return FALSE;
+	}
+	FDZReadHeader(data, &hdr);
+	if(hdr.magic != FDZ_MAGIC || hdr.version != FDZ_VERSION) {
+		return FALSE;
+	}
+	if(hdr.tracks != tracks || hdr.track_size != track_size) {
+		return FALSE;
+	}
+	if(size < FDZ_HEADER_SIZE + tracks * FDZ_INDEX_SIZE) {
+		return FALSE;
+	}
+
+	for(unsigned int i = 0; i < tracks; i++) {
+		FDZTRACK t;
+		FDZReadTrack(data, i, &t);
+		if((u64) t.offset + t.length > size) {
+			return FALSE;
+		}
+		switch(t.method) {
+			case FDZ_ZERO:
+			case FDZ_LZ:
+				break;
+			case FDZ_STORED:
+				if(t.length != track_size) {
+					return FALSE;
+				}
+				break;
+			default:
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* LZ payload: a sequence of tokens, each starting with a control byte c.
+ * c < 0x80: c + 1 literal bytes follow.
+ * c >= 0x80: copy (c & 0x7F) + 3 bytes from u16 (little endian) bytes back.
+ * The copy goes byte by byte, so a distance of 1 expands a run. */
+void FDZDecode(const u8* data, unsigned int track, u8* out, unsigned int track_size)
+{
+	FDZTRACK t;
+	FDZReadTrack(data, track, &t);
+	const u8* in = data + t.offset;
+	const u8* end = in + t.length;
+
+	switch(t.method) {
+		case FDZ_ZERO:
+			memset(out, 0, track_size);
+			return;
+		case FDZ_STORED:
+			memcpy(out, in, track_size);
+			return;
+	}
+
+	unsigned int pos = 0;
+	while(in < end) {
+		u8 c = *in++;
+		if(c < 0x80) {
+			unsigned int len = c + 1;
+			if(in + len > end || pos + len > track_size) {
+				break;
+			}
+			memcpy(out + pos, in, len);
+			in += len;
+			pos += len;
+		} else {
+			unsigned int len = (c & 0x7F) + FDZ_MIN_MATCH;
+			if(in + 2 > end) {
+				break;
+			}
+			unsigned int dist = in[0] | (in[1] << 8);
+			in += 2;
+			if(!dist || dist > pos || pos + len > track_size) {
+				break;
+			}
+			for(unsigned int i = 0; i < len; i++, pos++) {
+				out[pos] = out[pos - dist];
+			}
+		}
+	}
+
+	if(in != end || pos != track_size) {
+		printf("Invalid floppy container: track %u is corrupt\n", track);
+		exit(1);
+	}
+}
+
+static inline unsigned int FDZHash(const u8* p)
+{
+	u32 v = p[0] | (p[1] << 8) | (p[2] << 16);
+	return (v * 2654435761u) >> (32 - FDZ_HASH_BITS);
+}
+
+/* Greedy encoder: the longer of the last position with the same 3 byte
+ * prefix and the previous byte (run) wins. Returns 0 if the result does
+ * not fit into max bytes. */
+static unsigned int FDZCompress(const u8* in, unsigned int len, u8* out, unsigned int max)
+{
+	int head[1 << FDZ_HASH_BITS];
+	for(unsigned int i = 0; i < (1 << FDZ_HASH_BITS); i++) {
+		head[i] = -1;
+	}
+
+	unsigned int o = 0;
+	unsigned int lit = 0;	/* start of pending literals */
+	unsigned int i = 0;
+	while(i < len) {
+		unsigned int best_len = 0;
+		unsigned int best_dist = 0;
+
+		if(i + FDZ_MIN_MATCH <= len) {
+			unsigned int h = FDZHash(in + i);
+			int cand[2] = { head[h], (int) i - 1 };
+			head[h] = i;
+
+			for(unsigned int k = 0; k < 2; k++) {
+				if(cand[k] < 0 || i - cand[k] > 0xFFFF) {
+					continue;
+				}
+				unsigned int m = 0;
+				while(m < FDZ_MAX_MATCH && i + m < len && in[cand[k] + m] == in[i + m]) {
+					m++;
+				}
+				if(m > best_len) {
+					best_len = m;
+					best_dist = i - cand[k];
+				}
+			}
+		}
+
+		if(best_len < FDZ_MIN_MATCH) {
+			i++;
+			if(i - lit == FDZ_MAX_LITERAL || i == len) {
+				if(o + 1 + (i - lit) > max) {
+					return 0;
+				}
+				out[o++] = i - lit - 1;
+				memcpy(out + o, in + lit, i - lit);
+				o += i - lit;
+				lit = i;
+			}
+			continue;
+		}
+
+		if(lit < i) {
+			if(o + 1 + (i - lit) > max) {
+				return 0;
+			}
+			out[o++] = i - lit - 1;
+			memcpy(out + o, in + lit, i - lit);
+			o += i - lit;
+		}
+
+		if(o + 3 > max) {
+			return 0;
+		}
+		out[o++] = 0x80 | (best_len - FDZ_MIN_MATCH);
+		out[o++] = best_dist & 0xFF;
+		out[o++] = best_dist >> 8;
+
+		for(unsigned int k = 1; k < best_len && i + k + FDZ_MIN_MATCH <= len; k++) {
+			head[FDZHash(in + i + k)] = i + k;
+		}
+		i += best_len;
+		lit = i;
+	}
+
+	return o;
+}
+
+BOOL FDZPack(const u8* data, unsigned int tracks, unsigned int track_size, const char* filename)
+{
+	u32 header_size = FDZ_HEADER_SIZE + tracks * FDZ_INDEX_SIZE;
+	u8* buf = (u8*) calloc(1, header_size + tracks * track_size);
+	FDZTRACK* index = (FDZTRACK*) calloc(tracks, sizeof(FDZTRACK));
+	if(!buf || !index) {
+		printf("Error packing floppy: out of memory\n");
+		free(buf);
+		free(index);
+		return FALSE;
+	}
+
+	u32 size = header_size;
+	for(unsigned int i = 0; i < tracks; i++) {
+		const u8* track = data + i * track_size;
+		FDZTRACK* t = &index[i];
+
+		BOOL zero = TRUE;
+		for(unsigned int k = 0; k < track_size; k++) {
+			if(track[k]) {
+				zero = FALSE;
+				break;
+			}
+		}
+		if(zero) {
+			t->method = FDZ_ZERO;
+			t->offset = size;
+			continue;
+		}
+
+		u8* payload = buf + size;
+		unsigned int len = FDZCompress(track, track_size, payload, track_size - 1);
+		if(len) {
+			t->method = FDZ_LZ;
+		} else {
+			t->method = FDZ_STORED;
+			len = track_size;
+			memcpy(payload, track, track_size);
+		}
+		t->offset = size;
+		t->length = len;
+
+		/* identical payloads are stored once */
+		for(unsigned int j = 0; j < i; j++) {
+			const FDZTRACK* p = &index[j];
+			if(p->method == t->method && p->length == len && !memcmp(buf + p->offset, payload, len)) {
+				t->offset = p->offset;
+				len = 0;
+				break;
+			}
+		}
+
+		size += len;
+	}
+
+	FDZPut32(buf + 0, FDZ_MAGIC);
+	FDZPut16(buf + 4, FDZ_VERSION);
+	FDZPut16(buf + 6, tracks);
+	FDZPut32(buf + 8, track_size);
+	for(unsigned int i = 0; i < tracks; i++) {
+		u8* p = buf + FDZ_HEADER_SIZE + i * FDZ_INDEX_SIZE;
+		FDZPut32(p + 0, index[i].offset);
+		FDZPut16(p + 4, index[i].length);
+		p[6] = index[i].method;
+	}
+	free(index);
+
+	FILE* f = fopen(filename, "wb");
+	if(!f) {
+		printf("Error opening floppy container %s: %s\n", filename, strerror(errno));
+		free(buf);
+		return FALSE;
+	}
+
+	BOOL ok = fwrite(buf, size, 1, f) == 1;
+	fclose(f);
+	free(buf);
+
+	if(ok) {
+		printf("Packed floppy to %s: %u -> %u bytes\n", filename, tracks * track_size, size);
+	}
+
+	return ok;
+}
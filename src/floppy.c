@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "types.h"
+#include "floppy.h"
+
+static BOOL FDDWriteImage(Emulator* ctx, const char* filename)
+{
+	FDDDISK* disk = &ctx->disk;
+	FILE* f = NULL;
+	if(disk->flushed) {
+		f = fopen(filename, "r+b");
+	}
+
+	if(!f) {
+		/* first flush of the session: write the whole image once */
+		f = fopen(filename, "wb");
+		if(!f) {
+			printf("Error opening floppy image %s: %s\n", filename, strerror(errno));
+			return FALSE;
+		}
+
+		BOOL ok = fwrite(EMUPatchFloppy(ctx), FDD_SIZE, 1, f) == 1;
+		fclose(f);
+		return ok;
+	}
+
+	BOOL ok = TRUE;
+	for(unsigned int track = 0; track < FDD_TRACKS; track++) {
+		if(disk->dirty & ((u64) 1 << track)) {
+			ok &= fseek(f, track * FDD_TRACK_SIZE, SEEK_SET) == 0;
+			ok &= fwrite(EMUGetTrack(ctx, track), FDD_TRACK_SIZE, 1, f) == 1;
+		}
+	}
+	fclose(f);
+
+	return ok;
+}
+
+static void FDDPackJournal(u8* buf, const FDDJOURNAL* rec)
+{
+	u32 magic = U32L(rec->magic);
+	u64 cycle = U64L(rec->cycle);
+
+	memset(buf, 0, FDD_JOURNAL_SIZE);
+	memcpy(buf + 0, &magic, sizeof(magic));
+	buf[4] = rec->track;
+	memcpy(buf + 8, &cycle, sizeof(cycle));
+}
+
+static void FDDUnpackJournal(FDDJOURNAL* rec, const u8* buf)
+{
+	u32 magic;
+	u64 cycle;
+
+	memcpy(&magic, buf + 0, sizeof(magic));
+	memcpy(&cycle, buf + 8, sizeof(cycle));
+	rec->magic = U32L(magic);
+	rec->track = buf[4];
+	rec->cycle = U64L(cycle);
+}
+
+static BOOL FDDWriteJournal(Emulator* ctx, const char* filename)
+{
+	FDDDISK* disk = &ctx->disk;
+
+	FILE* f = fopen(filename, "ab");
+	if(!f) {
+		printf("Error opening floppy journal %s: %s\n", filename, strerror(errno));
+		return FALSE;
+	}
+
+	BOOL ok = TRUE;
+	for(unsigned int track = 0; track < FDD_TRACKS; track++) {
+		if(disk->dirty & ((u64) 1 << track)) {
+			FDDJOURNAL rec = {
+				.magic = FDD_JOURNAL_MAGIC,
+				.track = track,
+				.cycle = ctx->cycle
+			};
+			u8 hdr[FDD_JOURNAL_SIZE];
+			FDDPackJournal(hdr, &rec);
+			ok &= fwrite(hdr, sizeof(hdr), 1, f) == 1;
+			ok &= fwrite(EMUGetTrack(ctx, track), FDD_TRACK_SIZE, 1, f) == 1;
+		}
+	}
+	fclose(f);
+
+	return ok;
+}
+
+/* Write the tracks changed since the last flush to a full image file, to an
+ * append-only journal, or both. */
+BOOL FDDFlush(Emulator* ctx, const char* image_file, const char* journal_file)
+{
+	FDDDISK* disk = &ctx->disk;
+	BOOL ok = TRUE;
+
+	if(!disk->dirty) {
+		return TRUE;
+	}
+
+	if(image_file) {
+		ok &= FDDWriteImage(ctx, image_file);
+	}
+	if(journal_file) {
+		ok &= FDDWriteJournal(ctx, journal_file);
+	}
+
+	if(!ok) {
+		printf("Error flushing floppy\n");
+		return FALSE;
+	}
+
+#if defined(DEBUG_FDD) || defined(DEBUG_FDD_WRITE)
+	printf("FDD FLUSH: TRACKS=%09llX\n", (unsigned long long) disk->dirty);
+#endif
+
+	disk->dirty = 0;
+	disk->flushed = 1;
+
+	return TRUE;
+}
+
+/* Apply the records of an existing journal on top of the loaded image. A
+ * missing journal is not an error, a truncated last record is ignored. */
+BOOL FDDReplay(Emulator* ctx, const char* journal_file)
+{
+	FILE* f = fopen(journal_file, "rb");
+	if(!f) {
+		return errno == ENOENT;
+	}
+
+	unsigned int count = 0;
+	u8 hdr[FDD_JOURNAL_SIZE];
+	while(fread(hdr, sizeof(hdr), 1, f) == 1) {
+		FDDJOURNAL rec;
+		FDDUnpackJournal(&rec, hdr);
+		if(rec.magic != FDD_JOURNAL_MAGIC || rec.track >= FDD_TRACKS) {
+			printf("Invalid floppy journal %s\n", journal_file);
+			fclose(f);
+			return FALSE;
+		}
+
+		u8 track[FDD_TRACK_SIZE];
+		if(fread(track, FDD_TRACK_SIZE, 1, f) != 1) {
+			break;
+		}
+
+		memcpy(EMUPatchFloppy(ctx) + rec.track * FDD_TRACK_SIZE, track, FDD_TRACK_SIZE);
+		count++;
+	}
+	fclose(f);
+
+	printf("Replayed %u track(s) from %s\n", count, journal_file);
+
+	return TRUE;
+}
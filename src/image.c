@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "image.h"
+
+#define	IMG_BUCKETS		256
+
+static IMAGE* images = NULL;
+static IMAGE* interned[IMG_BUCKETS];
+
+static void IMGUnlink(IMAGE* img)
+{
+	IMAGE** p = &images;
+	while(*p) {
+		if(*p == img) {
+			*p = img->next;
+			break;
+		}
+		p = &(*p)->next;
+	}
+	img->next = NULL;
+
+	free(img->name);
+	img->name = NULL;
+}
+
+static void IMGUnintern(IMAGE* img)
+{
+	IMAGE** p = &interned[img->hash % IMG_BUCKETS];
+	while(*p) {
+		if(*p == img) {
+			*p = img->hnext;
+			break;
+		}
+		p = &(*p)->hnext;
+	}
+	img->hnext = NULL;
+	img->interned = 0;
+}
+
+/* FNV-1a, 64 bit */
+static u64 IMGHash(const u8* data, u32 size)
+{
+	u64 hash = 0xCBF29CE484222325ULL;
+	for(u32 i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+static void IMGInsert(IMAGE* img, u64 hash)
+{
+	img->hash = hash;
+	img->interned = 1;
+	img->hnext = interned[hash % IMG_BUCKETS];
+	interned[hash % IMG_BUCKETS] = img;
+}
+
+static IMAGE* IMGLookup(const u8* data, u32 size, u64 hash)
+{
+	for(IMAGE* img = interned[hash % IMG_BUCKETS]; img; img = img->hnext) {
+		if(img->hash == hash && img->size == size && !memcmp(img->data, data, size)) {
+			return img;
+		}
+	}
+
+	return NULL;
+}
+
+/* A file may be loaded as different kinds of image (ROM, floppy), so the
+ * size is part of the key. */
+IMAGE* IMGFind(const char* name, u32 size)
+{
+	for(IMAGE* img = images; img; img = img->next) {
+		if(img->size == size && !strcmp(img->name, name)) {
+			return IMGRetain(img);
+		}
+	}
+
+	return NULL;
+}
+
+static IMAGE* IMGAlloc(const char* name, u32 size, u8* data, u32 mapped)
+{
+	IMAGE* img = (IMAGE*) malloc(sizeof(IMAGE));
+	if(!img || !data) {
+		printf("Error allocating image: out of memory\n");
+		exit(1);
+	}
+
+	img->next = NULL;
+	img->name = NULL;
+	img->hnext = NULL;
+	img->hash = 0;
+	img->interned = 0;
+	img->refs = 1;
+	img->size = size;
+	img->mapped = mapped;
+	img->parent = NULL;
+	img->data = data;
+
+	if(name) {
+		size_t len = strlen(name) + 1;
+		img->name = (char*) malloc(len);
+		if(!img->name) {
+			printf("Error allocating image: out of memory\n");
+			exit(1);
+		}
+		memcpy(img->name, name, len);
+		img->next = images;
+		images = img;
+	}
+
+	return img;
+}
+
+IMAGE* IMGCreate(const char* name, u32 size)
+{
+	return IMGAlloc(name, size, (u8*) calloc(1, size), 0);
+}
+
+/* Private file mapping: pages are read on demand and shared through the
+ * page cache until written. A file shorter than size is padded with
+ * anonymous zero pages. */
+static u8* IMGMapFile(const char* filename, u32 size, u32* mapped)
+{
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		perror("open");
+		exit(1);
+	}
+
+	struct stat st;
+	if(fstat(fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+
+	long page = sysconf(_SC_PAGESIZE);
+	u32 len = (size + page - 1) & ~(page - 1);
+	u8* data = (u8*) mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(data == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	size_t file_len = st.st_size < size ? st.st_size : size;
+	if(file_len && mmap(data, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+
+	close(fd);
+
+	*mapped = len;
+	return data;
+}
+
+IMAGE* IMGMap(const char* filename, u32 size)
+{
+	IMAGE* img = IMGFind(filename, size);
+	if(img) {
+		return img;
+	}
+
+	u32 mapped;
+	u8* data = IMGMapFile(filename, size, &mapped);
+	return IMGAlloc(filename, size, data, mapped);
+}
+
+/* The range is hashed, and thus paged in, only when the view is asked
+ * for; the parent is not read beyond it. */
+IMAGE* IMGInternView(IMAGE* parent, u32 offset, u32 size)
+{
+	const u8* data = parent->data + offset;
+	u64 hash = IMGHash(data, size);
+	IMAGE* same = IMGLookup(data, size, hash);
+	if(same) {
+		return IMGRetain(same);
+	}
+
+	IMAGE* img = (IMAGE*) malloc(sizeof(IMAGE));
+	if(!img) {
+		printf("Error allocating image: out of memory\n");
+		exit(1);
+	}
+	memset(img, 0, sizeof(IMAGE));
+	img->refs = 1;
+	img->size = size;
+	img->parent = IMGRetain(parent);
+	img->data = parent->data + offset;
+
+	IMGInsert(img, hash);
+
+	return img;
+}
+
+IMAGE* IMGInternData(const u8* data, u32 size)
+{
+	u64 hash = IMGHash(data, size);
+	IMAGE* same = IMGLookup(data, size, hash);
+	if(same) {
+		return IMGRetain(same);
+	}
+
+	IMAGE* img = IMGCreate(NULL, size);
+	memcpy(img->data, data, size);
+
+	IMGInsert(img, hash);
+
+	return img;
+}
+
+IMAGE* IMGRetain(IMAGE* img)
+{
+	img->refs++;
+	return img;
+}
+
+void IMGRelease(IMAGE* img)
+{
+	if(!img || --img->refs) {
+		return;
+	}
+
+	if(img->name) {
+		IMGUnlink(img);
+	}
+	if(img->interned) {
+		IMGUnintern(img);
+	}
+
+	if(img->parent) {
+		IMGRelease(img->parent);
+	} else if(img->mapped) {
+		munmap(img->data, img->mapped);
+	} else {
+		free(img->data);
+	}
+	free(img);
+}
+
+IMAGE* IMGUnshare(IMAGE* img)
+{
+	if(img->refs == 1 && !img->parent) {
+		/* sole owner: just take it out of the caches */
+		if(img->name) {
+			IMGUnlink(img);
+		}
+		if(img->interned) {
+			IMGUnintern(img);
+		}
+		return img;
+	}
+
+	IMAGE* copy;
+	if(img->mapped && img->name) {
+		/* a fresh private mapping of the same file */
+		u32 mapped;
+		u8* data = IMGMapFile(img->name, img->size, &mapped);
+		copy = IMGAlloc(NULL, img->size, data, mapped);
+	} else {
+		copy = IMGCreate(NULL, img->size);
+		memcpy(copy->data, img->data, img->size);
+	}
+	IMGRelease(img);
+
+	return copy;
+}
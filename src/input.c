@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "types.h"
+#include "emulator.h"
+#include "input.h"
+
+void INPInit(INPUT* input)
+{
+	input->events = NULL;
+	input->count = 0;
+	input->size = 0;
+	input->next = 0;
+}
+
+void INPFree(INPUT* input)
+{
+	free(input->events);
+	INPInit(input);
+}
+
+void INPAdd(INPUT* input, u64 cycle, u8 key, BOOL press)
+{
+	if(input->count == input->size) {
+		input->size = input->size ? input->size * 2 : 64;
+		input->events = (INPEVENT*) realloc(input->events, input->size * sizeof(INPEVENT));
+		if(!input->events) {
+			printf("Error allocating input events: out of memory\n");
+			exit(1);
+		}
+	}
+
+	/* scripts are mostly in order already, insert from the end */
+	unsigned int i = input->count++;
+	while(i > 0 && input->events[i - 1].cycle > cycle) {
+		input->events[i] = input->events[i - 1];
+		i--;
+	}
+
+	INPEVENT* evt = &input->events[i];
+	memset(evt, 0, sizeof(INPEVENT));
+	evt->cycle = cycle;
+	evt->key = key;
+	evt->press = !!press;
+}
+
+/* Parses a time: cycles, or milliseconds with a "ms" suffix. A leading '+'
+ * makes it relative to the previous line. */
+static BOOL INPParseTime(const char* s, u64 last, u64* cycle)
+{
+	BOOL relative = *s == '+';
+	if(relative) {
+		s++;
+	}
+
+	char* end;
+	double value = strtod(s, &end);
+	if(end == s || value < 0) {
+		return FALSE;
+	}
+
+	if(!strcmp(end, "ms")) {
+		value = value * CPU_CLOCK / 1000.0;
+	} else if(*end) {
+		return FALSE;
+	}
+
+	*cycle = (relative ? last : 0) + (u64) (value + 0.5);
+	return TRUE;
+}
+
+/* Parses a key: raw key id (optionally prefixed with 'k') or MIDI key with
+ * an 'm' prefix, using the same numbering as -k and -m. */
+static BOOL INPParseKey(const char* s, u8* key)
+{
+	BOOL midi = *s == 'm';
+	if(*s == 'k' || *s == 'm') {
+		s++;
+	}
+
+	char* end;
+	long id = strtol(s, &end, 10);
+	if(end == s || *end) {
+		return FALSE;
+	}
+
+	if(midi) {
+		if(id < 0 || id >= 49) {
+			return FALSE;
+		}
+		*key = EMUKeyboardToKey(id);
+	} else {
+		if(id < 0 || id >= 72) {
+			return FALSE;
+		}
+		*key = id;
+	}
+
+	return TRUE;
+}
+
+/* Input script: one "<time> <press|release> <key>" transition per line,
+ * '#' starts a comment. */
+BOOL INPLoad(INPUT* input, const char* filename)
+{
+	FILE* f = fopen(filename, "rt");
+	if(!f) {
+		printf("Error opening input script %s: %s\n", filename, strerror(errno));
+		return FALSE;
+	}
+
+	char line[256];
+	unsigned int lineno = 0;
+	u64 last = 0;
+	while(fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		char* comment = strchr(line, '#');
+		if(comment) {
+			*comment = 0;
+		}
+
+		char time[64];
+		char action[64];
+		char key[64];
+		char extra;
+		int n = sscanf(line, "%63s %63s %63s %c", time, action, key, &extra);
+		if(n <= 0) {
+			continue;
+		}
+
+		u64 cycle;
+		u8 keyid;
+		BOOL press;
+		if(n != 3 || !INPParseTime(time, last, &cycle) || !INPParseKey(key, &keyid)) {
+			printf("Invalid input script %s:%u\n", filename, lineno);
+			fclose(f);
+			return FALSE;
+		}
+
+		if(!strcmp(action, "press")) {
+			press = TRUE;
+		} else if(!strcmp(action, "release")) {
+			press = FALSE;
+		} else {
+			printf("Invalid input script %s:%u: unknown action '%s'\n", filename, lineno, action);
+			fclose(f);
+			return FALSE;
+		}
+
+		INPAdd(input, cycle, keyid, press);
+		last = cycle;
+	}
+
+	fclose(f);
+
+	return TRUE;
+}
@@ -2,10 +2,161 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <unistd.h>
 
 #include "z80.h"
 #include "emulator.h"
 #include "trace.h"
+#include "snapshot.h"
+#include "shm.h"
+#include "serial.h"
+#include "panel.h"
+#include "boot.h"
+#include "floppy.h"
+#include "fdz.h"
+#include "input.h"
+#include "midi.h"
+#include "voice.h"
+#include "pool.h"
+
+static volatile sig_atomic_t flush_request = 0;
+
+static void on_flush_signal(int sig)
+{
+	(void) sig;
+	flush_request = 1;
+}
+
+/* run the machine until it stops on its own: a disk load error, or with
+ * auto_exit once the pressed key changed the LEDs or the OS is idle */
+static BOOL run(Emulator* emulator, Z80* ctx, int keyid, BOOL auto_exit, INPUT* input, const char** midi_file, const char* writeback_file, const char* journal_file)
+{
+	/*for(unsigned int i = 0; i < 10000; i++) { */
+	BOOL loc5 = FALSE;
+	BOOL locBE = FALSE;
+	BOOL loc78D = FALSE;
+
+	BOOL triggered = FALSE;
+
+	u8 old_i = 0;
+	u8 old_im = 0;
+	u8 old_ei = 0;
+
+	unsigned int countdown = 0;
+	unsigned int countdown_scan = 0;
+	u64 idle_passes = 0;
+
+	while(1) {
+		/* printf("PC=%04X AF=%04X BC=%04X DE=%04X HL=%04X\n", ctx->state.pc, ctx->state.af.value_uint16, ctx->state.bc.value_uint16, ctx->state.de.value_uint16, ctx->state.hl.value_uint16); */
+		TRCStep(emulator);
+		if(old_i != ctx->state.i) {
+			old_i = ctx->state.i;
+			TRCSetI(ctx->state.i);
+		}
+		if(old_im != ctx->state.internal.im) {
+			old_im = ctx->state.internal.im;
+			TRCSetIM(old_im);
+		}
+		if(old_ei != ctx->state.internal.iff2) {
+			old_ei = ctx->state.internal.iff2;
+			TRCSetEI(old_ei);
+		}
+		z80_run(ctx, 1);
+		EMUStep(emulator);
+
+		if(flush_request) {
+			flush_request = 0;
+			if(writeback_file || journal_file) {
+				FDDFlush(emulator, writeback_file, journal_file);
+			}
+			PNLFlush(emulator);
+			VOCFlush(emulator);
+		}
+
+		/* terminate on disk load error */
+		if(ctx->state.pc == 5) {
+			if(loc5) {
+				break;
+			} else {
+				loc5 = TRUE;
+			}
+		}
+
+		/* terminate in disk wait loop */
+		if(ctx->state.pc == 0xBE) {
+			if(locBE) {
+				if(!countdown) {
+					TROFF();
+				} else {
+					countdown--;
+				}
+			} else {
+				locBE = TRUE;
+				countdown = 10;
+			}
+		} else {
+			TRON();
+			locBE = FALSE;
+		}
+
+#define DLY 30
+		/* scan function */
+		if(ctx->state.pc == 0x078D) {
+			/* skipped idle passes count as visits */
+			u64 skipped = emulator->idle_pass.passes - idle_passes;
+			idle_passes = emulator->idle_pass.passes;
+			countdown_scan -= skipped < countdown_scan ? skipped : countdown_scan;
+
+			if(loc78D) {
+				if(!countdown_scan) {
+					if(!triggered && keyid >= 0) {
+						printf("PRESSING KEY %d\n", keyid);
+						EMUPressKey(emulator, keyid);
+						countdown_scan = DLY;
+						triggered = TRUE;
+					} else if(auto_exit && input->next == input->count) {
+						printf("No action, stopping\n");
+						break;
+					}
+				} else {
+					countdown_scan--;
+				}
+			} else {
+				loc78D = TRUE;
+				countdown_scan = DLY;
+
+				/* the song starts once the OS scans the keyboard */
+				if(*midi_file) {
+					if(!MIDILoad(input, *midi_file, emulator->cycle)) {
+						return FALSE;
+					}
+					EMUSetInput(emulator, input);
+					*midi_file = NULL;
+				}
+			}
+		}
+
+		if(triggered && auto_exit) {
+			/* check LED state */
+			u16 leds = EMUGetLEDs(emulator);
+			u8 seqleds = EMUGetSEQLEDs(emulator);
+			if(leds != 0xFFFF || seqleds != 0xFF) {
+				break;
+			}
+		}
+
+		/* alloc_voice */
+		if(ctx->state.pc == 0x1167) {
+			/* argument is in register A */
+			u8 a = ctx->state.af.value_uint16 >> 8;
+			printf("alloc_voice(%u)\n", a);
+		}
+	}
+
+
+	return TRUE;
+}
 
 /* EMULATOR OS MEMORY MAP (LATEST OS):
  * 0436: scan_row
@@ -20,18 +171,40 @@ int main(int argc, char** argv)
 	const char* trc_file = NULL;
 	const char* os_file = NULL;
 	const char* rom_file = "roms/820816-0181.bin";
+	const char* snap_file = NULL;
+	const char* shm_name = NULL;
+	char shm_default[32];
+	const char* serial_spec = NULL;
+	const char* panel_file = NULL;
+	const char* audio_file = NULL;
+	const char* writeback_file = NULL;
+	const char* journal_file = NULL;
+	const char* pack_file = NULL;
+	const char* input_file = NULL;
+	const char* midi_file = NULL;
+	const char* diff_file[2] = { NULL, NULL };
 	BOOL auto_exit = FALSE;
 	BOOL patch_serial = FALSE;
+	BOOL turbo_dma = FALSE;
+	BOOL fast_disk = FALSE;
+	BOOL hle_boot = FALSE;
+	BOOL sweep = FALSE;
+	u16 hle_pc = BOOT_ENTRY;
+	u16 idle_pc = 0;
 
-	Emulator* emulator = (Emulator*) malloc(sizeof(Emulator));
+	Emulator* emulator;
+	POOL* pool = NULL;
 	Z80 ctx;
+	INPUT input;
 
 	for(unsigned int i = 1; i < argc; i++) {
 		const char* arg = argv[i];
 		if(arg[0] == '-') {
 			switch(arg[1]) {
 				case 'h':
-					printf("Usage: %s [-k<key-id> | -m<midi-key-id>] [-t<trace.trc>] [floppy.img]\n", *argv);
+					printf("Usage: %s [-k<key-id> | -m<midi-key-id> | -S] [-i<script>] [-M<song.mid>] [-t<trace.trc>] [-b<pty|unix:path|file>] [-l<leds.bin>] [-A<audio.wav>] [-T] [-f] [-a[<pc>]] [-H[<pc>]] [-W<image>] [-j<journal>] [-x<snapshot>] [-d<snapshot>] [floppy.img]\n", *argv);
+					printf("       %s -z<packed.fdz> [-o<os-file>] [-s] floppy.img\n", *argv);
+					printf("       %s -d<a.snap> -d<b.snap>\n", *argv);
 					return 0;
 				case 'k': {
 					/* key input */
@@ -52,6 +225,18 @@ int main(int argc, char** argv)
 					keyid = EMUKeyboardToKey(midi);
 					break;
 				}
+				case 'S':
+					/* press every key in turn */
+					sweep = TRUE;
+					break;
+				case 'i':
+					/* input timeline */
+					input_file = &arg[2];
+					break;
+				case 'M':
+					/* MIDI file playback */
+					midi_file = &arg[2];
+					break;
 				case 't':
 					/* trace file */
 					if(!arg[2]) {
@@ -80,6 +265,70 @@ int main(int argc, char** argv)
 					/* ROM file */
 					rom_file = &arg[2];
 					break;
+				case 'T':
+					/* turbo floppy DMA */
+					turbo_dma = TRUE;
+					break;
+				case 'f':
+					/* fast disk */
+					fast_disk = TRUE;
+					break;
+				case 'a':
+					/* idle loop accelerator, default: keyboard scan */
+					idle_pc = arg[2] ? strtoul(&arg[2], NULL, 16) : 0x078D;
+					break;
+				case 'H':
+					/* high level boot, optionally with the OS entry after loading */
+					hle_boot = TRUE;
+					if(arg[2]) {
+						hle_pc = strtoul(&arg[2], NULL, 16);
+					}
+					break;
+				case 'W':
+					/* write changed tracks back to an image file */
+					writeback_file = &arg[2];
+					break;
+				case 'j':
+					/* journal changed tracks */
+					journal_file = &arg[2];
+					break;
+				case 'z':
+					/* pack floppy into a compressed container */
+					pack_file = &arg[2];
+					break;
+				case 'x':
+					/* save snapshot on exit */
+					snap_file = &arg[2];
+					break;
+				case 'b':
+					/* SIO channel B bridge */
+					serial_spec = arg[2] ? &arg[2] : "pty";
+					break;
+				case 'A':
+					/* render the sample voices to a WAV file */
+					audio_file = &arg[2];
+					break;
+				case 'l':
+					/* binary LED stream */
+					panel_file = &arg[2];
+					break;
+				case 'v':
+					/* live shared memory view, by default one per process */
+					if(arg[2]) {
+						shm_name = &arg[2];
+					} else {
+						snprintf(shm_default, sizeof(shm_default), "/emulator-%d", (int) getpid());
+						shm_name = shm_default;
+					}
+					break;
+				case 'd':
+					/* compare against snapshot on exit */
+					if(diff_file[0]) {
+						diff_file[1] = &arg[2];
+					} else {
+						diff_file[0] = &arg[2];
+					}
+					break;
 				default:
 					printf("Invalid option: '%s'\n", arg);
 					return 1;
@@ -93,7 +342,53 @@ int main(int argc, char** argv)
 		}
 	}
 
-	EMUInit(emulator, &ctx, rom_file);
+	if(diff_file[1]) {
+		/* compare two snapshot files without running the emulator */
+		SNAPSHOT* a = (SNAPSHOT*) malloc(sizeof(SNAPSHOT));
+		SNAPSHOT* b = (SNAPSHOT*) malloc(sizeof(SNAPSHOT));
+		if(!SNAPLoad(a, diff_file[0]) || !SNAPLoad(b, diff_file[1])) {
+			return 1;
+		}
+		unsigned int count = SNAPDiff(a, b);
+		free(a);
+		free(b);
+		return count ? 2 : 0;
+	}
+
+	if(sweep) {
+		/* one instance, reset between the keys */
+		pool = POOLCreate(1, rom_file, TRUE);
+		emulator = POOLAcquire(pool, &ctx);
+	} else {
+		emulator = EMUCreate(&ctx, rom_file);
+	}
+	emulator->turbo_dma = turbo_dma;
+	emulator->fast_disk = fast_disk;
+	EMUSetIdleEntry(emulator, idle_pc);
+
+	INPInit(&input);
+	if(input_file) {
+		if(!INPLoad(&input, input_file)) {
+			return 1;
+		}
+		EMUSetInput(emulator, &input);
+	}
+
+	if(shm_name) {
+		SHMAttach(emulator, shm_name);
+	}
+
+	if(serial_spec) {
+		SERAttach(emulator, serial_spec);
+	}
+
+	if(panel_file) {
+		PNLOpen(emulator, panel_file);
+	}
+
+	if(audio_file) {
+		VOCOpen(emulator, audio_file);
+	}
 
 	if(fdd_image) {
 		EMULoadFloppy(emulator, fdd_image);
@@ -108,13 +403,13 @@ int main(int argc, char** argv)
 			printf("Error loading OS file %s: %s\n", os_file, strerror(errno));
 			return 1;
 		}
-		fread(emulator->fdd.data, 2 * FDD_TRACK_SIZE, 1, os);
+		fread(EMUPatchFloppy(emulator), 2 * FDD_TRACK_SIZE, 1, os);
 		fclose(os);
 	}
 
 	BOOL valid = FALSE;
 	for(unsigned int i = 0; i < 0x100; i++) {
-		if(emulator->fdd.data[i] != 0) {
+		if(EMUGetTrack(emulator, 0)[i] != 0) {
 			valid = TRUE;
 			break;
 		}
@@ -125,11 +420,30 @@ int main(int argc, char** argv)
 	}
 
 	if(patch_serial) {
-		u8* floppy = emulator->fdd.data;
+		u8* floppy = EMUPatchFloppy(emulator);
 		floppy[3] = emulator->rom[0x5F];
 		floppy[4] = emulator->rom[0x60];
 	}
 
+	if(journal_file && !FDDReplay(emulator, journal_file)) {
+		return 1;
+	}
+
+	if(pack_file) {
+		BOOL ok = FDZPack(EMUPatchFloppy(emulator), FDD_TRACKS, FDD_TRACK_SIZE, pack_file);
+		if(pool) {
+			POOLDelete(pool);
+		} else {
+			EMUDelete(emulator);
+		}
+		return ok ? 0 : 1;
+	}
+
+	if(writeback_file || journal_file || panel_file || audio_file) {
+		/* flush on request */
+		signal(SIGUSR1, on_flush_signal);
+	}
+
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.context = (void*) emulator;
 	ctx.read = z80read;
@@ -137,6 +451,7 @@ int main(int argc, char** argv)
 	ctx.in = z80in;
 	ctx.out = z80out;
 	ctx.int_data = z80int;
+	ctx.reti = z80reti;
 
 	if(trc_file) {
 		printf("Opening trace file %s\n", trc_file);
@@ -146,111 +461,79 @@ int main(int argc, char** argv)
 
 	printf("Starting Emulator...\n");
 
-	z80_power(&ctx, TRUE);
-	z80_reset(&ctx);
-
-	/*for(unsigned int i = 0; i < 10000; i++) { */
-	BOOL loc5 = FALSE;
-	BOOL locBE = FALSE;
-	BOOL loc78D = FALSE;
+	if(sweep) {
+		/* the same job for every key, each on a freshly reset instance */
+		for(keyid = 0; keyid < 72; keyid++) {
+			if(keyid) {
+				POOLRelease(pool, emulator);
+				emulator = POOLAcquire(pool, &ctx);
+				ctx.context = (void*) emulator;
+			}
 
-	BOOL triggered = FALSE;
+			z80_power(&ctx, TRUE);
+			z80_reset(&ctx);
 
-	u8 old_i = 0;
-	u8 old_im = 0;
-	u8 old_ei = 0;
+			if(hle_boot) {
+				BOOTLoad(emulator, hle_pc);
+			}
 
-	unsigned int countdown = 0;
-	unsigned int countdown_scan = 0;
+			if(!run(emulator, &ctx, keyid, TRUE, &input, &midi_file, writeback_file, journal_file)) {
+				return 1;
+			}
 
-	while(1) {
-		/* printf("PC=%04X AF=%04X BC=%04X DE=%04X HL=%04X\n", ctx.state.pc, ctx.state.af.value_uint16, ctx.state.bc.value_uint16, ctx.state.de.value_uint16, ctx.state.hl.value_uint16); */
-		TRCStep(emulator);
-		if(old_i != ctx.state.i) {
-			old_i = ctx.state.i;
-			TRCSetI(ctx.state.i);
-		}
-		if(old_im != ctx.state.internal.im) {
-			old_im = ctx.state.internal.im;
-			TRCSetIM(old_im);
+			printf("KEY %d at cycle %llu: ", keyid, (unsigned long long) emulator->cycle);
+			EMUPrintLEDs(EMUGetLEDs(emulator), EMUGetSEQLEDs(emulator));
 		}
-		if(old_ei != ctx.state.internal.iff2) {
-			old_ei = ctx.state.internal.iff2;
-			TRCSetEI(old_ei);
-		}
-		z80_run(&ctx, 1);
-		EMUStep(emulator);
+	} else {
+		z80_power(&ctx, TRUE);
+		z80_reset(&ctx);
 
-		/* terminate on disk load error */
-		if(ctx.state.pc == 5) {
-			if(loc5) {
-				break;
-			} else {
-				loc5 = TRUE;
-			}
+		if(hle_boot) {
+			BOOTLoad(emulator, hle_pc);
 		}
 
-		/* terminate in disk wait loop */
-		if(ctx.state.pc == 0xBE) {
-			if(locBE) {
-				if(!countdown) {
-					TROFF();
-				} else {
-					countdown--;
-				}
-			} else {
-				locBE = TRUE;
-				countdown = 10;
-			}
-		} else {
-			TRON();
-			locBE = FALSE;
+		if(!run(emulator, &ctx, keyid, auto_exit, &input, &midi_file, writeback_file, journal_file)) {
+			return 1;
 		}
+	}
 
-#define DLY 30
-		/* scan function */
-		if(ctx.state.pc == 0x078D) {
-			if(loc78D) {
-				if(!countdown_scan) {
-					if(!triggered && keyid >= 0) {
-						printf("PRESSING KEY %d\n", keyid);
-						EMUPressKey(emulator, keyid);
-						countdown_scan = DLY;
-						triggered = TRUE;
-					} else if(auto_exit) {
-						printf("No action, stopping\n");
-						break;
-					}
-				} else {
-					countdown_scan--;
-				}
-			} else {
-				loc78D = TRUE;
-				countdown_scan = DLY;
-			}
+	printf("Execution stopped\n");
+
+	if(writeback_file || journal_file) {
+		FDDFlush(emulator, writeback_file, journal_file);
+	}
+
+	if(emulator->shm) {
+		SHMUpdate(emulator);
+	}
+
+	if(snap_file || diff_file[0]) {
+		SNAPSHOT* snap = (SNAPSHOT*) malloc(sizeof(SNAPSHOT));
+		SNAPTake(snap, emulator);
+
+		if(snap_file && !SNAPSave(snap, snap_file)) {
+			return 1;
 		}
 
-		if(triggered && auto_exit) {
-			/* check LED state */
-			u16 leds = EMUGetLEDs(emulator);
-			u8 seqleds = EMUGetSEQLEDs(emulator);
-			if(leds != 0xFFFF || seqleds != 0xFF) {
-				break;
+		if(diff_file[0]) {
+			SNAPSHOT* ref = (SNAPSHOT*) malloc(sizeof(SNAPSHOT));
+			if(!SNAPLoad(ref, diff_file[0])) {
+				return 1;
 			}
+			SNAPDiff(ref, snap);
+			free(ref);
 		}
 
-		/* alloc_voice */
-		if(ctx.state.pc == 0x1167) {
-			/* argument is in register A */
-			u8 a = ctx.state.af.value_uint16 >> 8;
-			printf("alloc_voice(%u)\n", a);
-		}
+		free(snap);
 	}
 
-	printf("Execution stopped\n");
-
 	TRCClose();
-	free(emulator);
+	if(pool) {
+		POOLDelete(pool);
+	} else {
+		EMUDelete(emulator);
+	}
+	INPFree(&input);
 
 	return 0;
 }
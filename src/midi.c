@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "types.h"
+#include "emulator.h"
+#include "midi.h"
+
+typedef struct {
+	u64	tick;
+	u32	order;
+	u8	key;
+	u8	press;
+} MIDINOTE;
+
+typedef struct {
+	u64	tick;
+	u32	order;
+	u32	tempo;		/* microseconds per quarter note */
+} MIDITEMPO;
+
+typedef struct {
+	MIDINOTE*	notes;
+	unsigned int	note_count;
+	unsigned int	note_size;
+
+	MIDITEMPO*	tempos;
+	unsigned int	tempo_count;
+	unsigned int	tempo_size;
+
+	unsigned int	dropped;
+} MIDISONG;
+
+static void* MIDIGrow(void* data, unsigned int* size, unsigned int count, size_t item)
+{
+	if(count < *size) {
+		return data;
+	}
+
+	*size = *size ? *size * 2 : 256;
+	data = realloc(data, *size * item);
+	if(!data) {
+		printf("Error loading MIDI file: out of memory\n");
+		exit(1);
+	}
+
+	return data;
+}
+
+static inline u32 MIDIRead32(const u8* p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline u16 MIDIRead16(const u8* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+/* variable length quantity, at most 4 bytes */
+static BOOL MIDIReadVLQ(const u8** p, const u8* end, u32* value)
+{
+	u32 v = 0;
+	for(unsigned int i = 0; i < 4; i++) {
+		if(*p >= end) {
+			return FALSE;
+		}
+		u8 c = *(*p)++;
+		v = (v << 7) | (c & 0x7F);
+		if(!(c & 0x80)) {
+			*value = v;
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+static void MIDIAddNote(MIDISONG* song, u64 tick, u8 note, BOOL press)
+{
+	if(note < MIDI_NOTE_BASE || note > MIDI_NOTE_BASE + 48) {
+		song->dropped += press;
+		return;
+	}
+
+	song->notes = (MIDINOTE*) MIDIGrow(song->notes, &song->note_size, song->note_count, sizeof(MIDINOTE));
+	MIDINOTE* n = &song->notes[song->note_count];
+	n->tick = tick;
+	n->order = song->note_count++;
+	n->key = EMUKeyboardToKey(note - MIDI_NOTE_BASE);
+	n->press = press;
+}
+
+static void MIDIAddTempo(MIDISONG* song, u64 tick, u32 tempo)
+{
+	song->tempos = (MIDITEMPO*) MIDIGrow(song->tempos, &song->tempo_size, song->tempo_count, sizeof(MIDITEMPO));
+	MIDITEMPO* t = &song->tempos[song->tempo_count];
+	t->tick = tick;
+	t->order = song->tempo_count++;
+	t->tempo = tempo;
+}
+
+/* Parses one MTrk chunk. Only note on/off and tempo changes are kept. */
+static BOOL MIDIParseTrack(MIDISONG* song, const u8* p, const u8* end)
+{
+	static const u8 data_bytes[8] = { 2, 2, 2, 2, 1, 1, 2, 0 };
+
+	u64 tick = 0;
+	u8 status = 0;
+	while(p < end) {
+		u32 delta;
+		if(!MIDIReadVLQ(&p, end, &delta) || p >= end) {
+			return FALSE;
+		}
+		tick += delta;
+
+		if(*p & 0x80) {
+			status = *p++;
+		} else if(!status) {
+			return FALSE;
+		}
+
+		if(status == 0xFF) {
+			/* meta event */
+			u32 len;
+			if(p >= end) {
+				return FALSE;
+			}
+			u8 type = *p++;
+			if(!MIDIReadVLQ(&p, end, &len) || len > end - p) {
+				return FALSE;
+			}
+			if(type == 0x51 && len == 3) {
+				MIDIAddTempo(song, tick, (p[0] << 16) | (p[1] << 8) | p[2]);
+			} else if(type == 0x2F) {
+				return TRUE;
+			}
+			p += len;
+			status = 0;
+		} else if(status == 0xF0 || status == 0xF7) {
+			/* sysex */
+			u32 len;
+			if(!MIDIReadVLQ(&p, end, &len) || len > end - p) {
+				return FALSE;
+			}
+			p += len;
+			status = 0;
+		} else if(status < 0xF0) {
+			unsigned int n = data_bytes[(status >> 4) & 7];
+			if(end - p < n) {
+				return FALSE;
+			}
+			switch(status & 0xF0) {
+				case 0x80:
+					MIDIAddNote(song, tick, p[0], FALSE);
+					break;
+				case 0x90:
+					MIDIAddNote(song, tick, p[0], p[1] != 0);
+					break;
+			}
+			p += n;
+		} else {
+			/* system common messages do not belong into files */
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+static int MIDICompareNotes(const void* a, const void* b)
+{
+	const MIDINOTE* x = (const MIDINOTE*) a;
+	const MIDINOTE* y = (const MIDINOTE*) b;
+
+	if(x->tick != y->tick) {
+		return x->tick < y->tick ? -1 : 1;
+	}
+	return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+static int MIDICompareTempos(const void* a, const void* b)
+{
+	const MIDITEMPO* x = (const MIDITEMPO*) a;
+	const MIDITEMPO* y = (const MIDITEMPO*) b;
+
+	if(x->tick != y->tick) {
+		return x->tick < y->tick ? -1 : 1;
+	}
+	return x->order < y->order ? -1 : (x->order > y->order);
+}
+
+static BOOL MIDIParse(MIDISONG* song, const u8* data, u32 size, u16* division)
+{
+	if(size < 14 || memcmp(data, "MThd", 4) || MIDIRead32(data + 4) < 6) {
+		return FALSE;
+	}
+
+	u16 format = MIDIRead16(data + 8);
+	u16 tracks = MIDIRead16(data + 10);
+	*division = MIDIRead16(data + 12);
+	if(format > 2 || !*division) {
+		return FALSE;
+	}
+
+	const u8* p = data + 8 + MIDIRead32(data + 4);
+	const u8* end = data + size;
+	for(unsigned int i = 0; i < tracks; i++) {
+		if(end - p < 8) {
+			return FALSE;
+		}
+		u32 len = MIDIRead32(p + 4);
+		if(len > end - p - 8) {
+			return FALSE;
+		}
+		if(!memcmp(p, "MTrk", 4) && !MIDIParseTrack(song, p + 8, p + 8 + len)) {
+			return FALSE;
+		}
+		p += 8 + len;
+	}
+
+	return TRUE;
+}
+
+/* Standard MIDI file (format 0, 1 or 2 with all tracks merged): note on and
+ * off events of all channels are added to the input timeline at their
+ * emulated cycle, counted from start. Notes outside of the 49 key keyboard
+ * are dropped. */
+BOOL MIDILoad(INPUT* input, const char* filename, u64 start)
+{
+	FILE* f = fopen(filename, "rb");
+	if(!f) {
+		printf("Error opening MIDI file %s: %s\n", filename, strerror(errno));
+		return FALSE;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	u8* data = (u8*) malloc(size > 0 ? size : 1);
+	if(!data) {
+		printf("Error loading MIDI file: out of memory\n");
+		exit(1);
+	}
+	BOOL ok = size > 0 && fread(data, size, 1, f) == 1;
+	fclose(f);
+
+	MIDISONG song;
+	memset(&song, 0, sizeof(song));
+
+	u16 division = 0;
+	if(ok) {
+		ok = MIDIParse(&song, data, size, &division);
+	}
+	free(data);
+
+	if(!ok) {
+		printf("Invalid MIDI file %s\n", filename);
+		free(song.notes);
+		free(song.tempos);
+		return FALSE;
+	}
+
+	qsort(song.notes, song.note_count, sizeof(MIDINOTE), MIDICompareNotes);
+	qsort(song.tempos, song.tempo_count, sizeof(MIDITEMPO), MIDICompareTempos);
+
+	/* walk the tempo map: time is accumulated in microseconds per segment of
+	 * constant tempo; SMPTE divisions have a fixed tick length */
+	double us_per_tick;
+	BOOL smpte = division & 0x8000;
+	if(smpte) {
+		int fps = -(s8) (division >> 8);
+		us_per_tick = 1000000.0 / (fps * (division & 0xFF));
+	} else {
+		us_per_tick = 500000.0 / division;	/* 120 BPM until the first tempo change */
+	}
+
+	unsigned int tempo = 0;
+	u64 seg_tick = 0;
+	double seg_us = 0;
+	for(unsigned int i = 0; i < song.note_count; i++) {
+		MIDINOTE* n = &song.notes[i];
+
+		while(!smpte && tempo < song.tempo_count && song.tempos[tempo].tick <= n->tick) {
+			MIDITEMPO* t = &song.tempos[tempo++];
+			seg_us += (t->tick - seg_tick) * us_per_tick;
+			seg_tick = t->tick;
+			us_per_tick = (double) t->tempo / division;
+		}
+
+		double us = seg_us + (n->tick - seg_tick) * us_per_tick;
+		u64 cycle = start + (u64) (us * (CPU_CLOCK / 1000000.0) + 0.5);
+		INPAdd(input, cycle, n->key, n->press);
+	}
+
+	printf("Loaded MIDI file %s: %u note events", filename, song.note_count);
+	if(song.dropped) {
+		printf(", %u notes outside of the keyboard dropped", song.dropped);
+	}
+	printf("\n");
+
+	free(song.notes);
+	free(song.tempos);
+
+	return TRUE;
+}
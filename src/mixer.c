@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "mixer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define	MIX_X86
+#include <immintrin.h>
+#endif
+
+typedef void (*MIXKERNEL)(s16* out, const f32* in, unsigned int stride, const f32* gain, const f32* step, unsigned int voices, unsigned int frames, f32 scale);
+
+static const char* kernel_name = "scalar";
+static MIXKERNEL kernel;
+
+static inline s16 MIXClip(f32 v)
+{
+	if(v >= 32767.0f) {
+		return 32767;
+	} else if(v <= -32768.0f) {
+		return -32768;
+	}
+	return (s16) v;
+}
+
+static void MIXBlockScalar(s16* out, const f32* in, unsigned int stride, const f32* gain, const f32* step, unsigned int voices, unsigned int frames, f32 scale)
+{
+	for(unsigned int i = 0; i < frames; i++) {
+		f32 acc = 0;
+		for(unsigned int v = 0; v < voices; v++) {
+			acc += (gain[v] + (f32) i * step[v]) * in[v * stride + i];
+		}
+		out[i] = MIXClip(acc * scale);
+	}
+}
+
+#ifdef MIX_X86
+/* 8 frames per iteration, the voices are accumulated in the same order as
+ * in the scalar kernel, so all kernels produce the same result. */
+__attribute__((target("sse2")))
+static void MIXRangeSSE2(s16* out, const f32* in, unsigned int stride, const f32* gain, const f32* step, unsigned int voices, unsigned int i, unsigned int frames, f32 scale)
+{
+	const __m128 lo = _mm_set1_ps(-32768.0f);
+	const __m128 hi = _mm_set1_ps(32767.0f);
+	const __m128 s = _mm_set1_ps(scale);
+
+	for(; i + 8 <= frames; i += 8) {
+		__m128 idx0 = _mm_setr_ps(i, i + 1, i + 2, i + 3);
+		__m128 idx1 = _mm_add_ps(idx0, _mm_set1_ps(4));
+		__m128 acc0 = _mm_setzero_ps();
+		__m128 acc1 = _mm_setzero_ps();
+		for(unsigned int v = 0; v < voices; v++) {
+			__m128 g = _mm_set1_ps(gain[v]);
+			__m128 d = _mm_set1_ps(step[v]);
+			const f32* row = in + v * stride + i;
+			acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_add_ps(g, _mm_mul_ps(idx0, d)), _mm_load_ps(row)));
+			acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_add_ps(g, _mm_mul_ps(idx1, d)), _mm_load_ps(row + 4)));
+		}
+		acc0 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(acc0, s), lo), hi);
+		acc1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(acc1, s), lo), hi);
+		__m128i pcm = _mm_packs_epi32(_mm_cvttps_epi32(acc0), _mm_cvttps_epi32(acc1));
+		_mm_storeu_si128((__m128i*) (out + i), pcm);
+	}
+
+	for(; i < frames; i++) {
+		f32 acc = 0;
+		for(unsigned int v = 0; v < voices; v++) {
+			acc += (gain[v] + (f32) i * step[v]) * in[v * stride + i];
+		}
+		out[i] = MIXClip(acc * scale);
+	}
+}
+
+__attribute__((target("sse2")))
+static void MIXBlockSSE2(s16* out, const f32* in, unsigned int stride, const f32* gain, const f32* step, unsigned int voices, unsigned int frames, f32 scale)
+{
+	MIXRangeSSE2(out, in, stride, gain, step, voices, 0, frames, scale);
+}
+
+__attribute__((target("avx2")))
+static void MIXBlockAVX2(s16* out, const f32* in, unsigned int stride, const f32* gain, const f32* step, unsigned int voices, unsigned int frames, f32 scale)
+{
+	const __m256 lo = _mm256_set1_ps(-32768.0f);
+	const __m256 hi = _mm256_set1_ps(32767.0f);
+	const __m256 s = _mm256_set1_ps(scale);
+
+	unsigned int i = 0;
+	for(; i + 16 <= frames; i += 16) {
+		__m256 idx0 = _mm256_setr_ps(i, i + 1, i + 2, i + 3, i + 4, i + 5, i + 6, i + 7);
+		__m256 idx1 = _mm256_add_ps(idx0, _mm256_set1_ps(8));
+		__m256 acc0 = _mm256_setzero_ps();
+		__m256 acc1 = _mm256_setzero_ps();
+		for(unsigned int v = 0; v < voices; v++) {
+			__m256 g = _mm256_set1_ps(gain[v]);
+			__m256 d = _mm256_set1_ps(step[v]);
+			const f32* row = in + v * stride + i;
+			acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_add_ps(g, _mm256_mul_ps(idx0, d)), _mm256_load_ps(row)));
+			acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_add_ps(g, _mm256_mul_ps(idx1, d)), _mm256_load_ps(row + 8)));
+		}
+		acc0 = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(acc0, s), lo), hi);
+		acc1 = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(acc1, s), lo), hi);
+
+		/* packs works per 128 bit lane, restore the frame order */
+		__m256i pcm = _mm256_packs_epi32(_mm256_cvttps_epi32(acc0), _mm256_cvttps_epi32(acc1));
+		pcm = _mm256_permute4x64_epi64(pcm, 0xD8);
+		_mm256_storeu_si256((__m256i*) (out + i), pcm);
+	}
+
+	MIXRangeSSE2(out, in, stride, gain, step, voices, i, frames, scale);
+}
+#endif
+
+BOOL MIXSelect(const char* name)
+{
+	if(!strcmp(name, "scalar")) {
+		kernel_name = "scalar";
+		kernel = MIXBlockScalar;
+		return TRUE;
+	}
+
+#ifdef MIX_X86
+	__builtin_cpu_init();
+	if(!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+		kernel_name = "avx2";
+		kernel = MIXBlockAVX2;
+		return TRUE;
+	}
+	if(!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")) {
+		kernel_name = "sse2";
+		kernel = MIXBlockSSE2;
+		return TRUE;
+	}
+#endif
+
+	return FALSE;
+}
+
+void MIXInit(void)
+{
+	if(kernel) {
+		return;
+	}
+
+	if(!MIXSelect("avx2") && !MIXSelect("sse2")) {
+		MIXSelect("scalar");
+	}
+}
+
+const char* MIXKernel(void)
+{
+	return kernel_name;
+}
+
+void MIXBlock(s16* out, const f32* in, unsigned int stride, const f32* gain, const f32* step, unsigned int voices, unsigned int frames, f32 scale)
+{
+	kernel(out, in, stride, gain, step, voices, frames, scale);
+}
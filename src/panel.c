@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "types.h"
+#include "panel.h"
+
+void PNLOpen(Emulator* ctx, const char* filename)
+{
+	PANEL* pnl = (PANEL*) malloc(sizeof(PANEL));
+	if(!pnl) {
+		printf("Error allocating panel stream: out of memory\n");
+		exit(1);
+	}
+
+	pnl->file = fopen(filename, "wb");
+	if(!pnl->file) {
+		printf("Error opening panel stream %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	pnl->count = 0;
+
+	PNLHEADER hdr = {
+		.magic = U32L(PNL_MAGIC),
+		.version = U16L(PNL_VERSION),
+		.record_size = U16L(sizeof(PNLRECORD)),
+		.clock = U32L(CPU_CLOCK)
+	};
+	fwrite(&hdr, sizeof(hdr), 1, pnl->file);
+
+	ctx->panel = pnl;
+
+	for(unsigned int reg = 0; reg < PNL_REGS; reg++) {
+		PNLRecord(ctx, reg, ctx->led_reg[reg]);
+	}
+}
+
+void PNLClose(Emulator* ctx)
+{
+	PANEL* pnl = ctx->panel;
+	if(!pnl) {
+		return;
+	}
+
+	PNLFlush(ctx);
+	fclose(pnl->file);
+	free(pnl);
+
+	ctx->panel = NULL;
+}
+
+void PNLRecord(Emulator* ctx, u8 reg, u8 value)
+{
+	PANEL* pnl = ctx->panel;
+
+	PNLRECORD* rec = &pnl->buffer[pnl->count++];
+	rec->cycle = U64L(ctx->cycle);
+	rec->reg = reg;
+	rec->value = value;
+
+	if(pnl->count == PNL_BUFFER) {
+		PNLFlush(ctx);
+	}
+}
+
+void PNLFlush(Emulator* ctx)
+{
+	PANEL* pnl = ctx->panel;
+	if(!pnl || !pnl->count) {
+		return;
+	}
+
+	fwrite(pnl->buffer, sizeof(PNLRECORD), pnl->count, pnl->file);
+	fflush(pnl->file);
+	pnl->count = 0;
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "types.h"
+#include "pool.h"
+
+#define	HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+POOL* POOLCreate(unsigned int count, const char* rom_file, BOOL huge)
+{
+	POOL* pool = (POOL*) malloc(sizeof(POOL));
+	unsigned int* free_list = (unsigned int*) malloc(count * sizeof(unsigned int));
+	if(!pool || !free_list) {
+		printf("Error allocating pool: out of memory\n");
+		exit(1);
+	}
+
+	/* RAM first, it is page aligned by construction */
+	size_t ram_size = (size_t) count * EMU_RAM_SIZE;
+	size_t size = ram_size + (size_t) count * sizeof(Emulator);
+	void* mem = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if(huge) {
+		size_t huge_size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t) (HUGE_PAGE_SIZE - 1);
+		mem = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if(mem != MAP_FAILED) {
+			size = huge_size;
+		} else {
+			printf("Huge pages not available, using normal pages\n");
+			huge = FALSE;
+		}
+	}
+#else
+	huge = FALSE;
+#endif
+
+	if(mem == MAP_FAILED) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mem == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+	}
+
+	pool->count = count;
+	pool->free_count = count;
+	pool->free_list = free_list;
+	pool->ram = (u8*) mem;
+	pool->instances = (Emulator*) (pool->ram + ram_size);
+	pool->size = size;
+	pool->huge = huge;
+
+	/* anonymous memory is zero, so the RAM starts out clean */
+	for(unsigned int i = 0; i < count; i++) {
+		EMUInitRAM(&pool->instances[i], NULL, rom_file, pool->ram + (size_t) i * EMU_RAM_SIZE);
+		free_list[i] = count - i - 1;
+	}
+
+	return pool;
+}
+
+void POOLDelete(POOL* pool)
+{
+	for(unsigned int i = 0; i < pool->count; i++) {
+		EMUDestroy(&pool->instances[i]);
+	}
+
+	munmap(pool->ram, pool->size);
+	free(pool->free_list);
+	free(pool);
+}
+
+Emulator* POOLAcquire(POOL* pool, Z80* z80)
+{
+	if(!pool->free_count) {
+		return NULL;
+	}
+
+	Emulator* ctx = &pool->instances[pool->free_list[--pool->free_count]];
+
+	EMUReset(ctx);
+	ctx->z80 = z80;
+
+	return ctx;
+}
+
+void POOLRelease(POOL* pool, Emulator* ctx)
+{
+	pool->free_list[pool->free_count++] = (unsigned int) (ctx - pool->instances);
+}
@@ -0,0 +1,57 @@
+#include "types.h"
+#include "sched.h"
+
+static void SCHEDUpdate(SCHED* sched)
+{
+	u64 next = SCHED_NEVER;
+	for(unsigned int i = 0; i < EVT_COUNT; i++) {
+		if(sched->deadline[i] < next) {
+			next = sched->deadline[i];
+		}
+	}
+	sched->next = next;
+}
+
+void SCHEDInit(SCHED* sched, const SCHEDHANDLER* handler)
+{
+	sched->next = SCHED_NEVER;
+	sched->handler = handler;
+	for(unsigned int i = 0; i < EVT_COUNT; i++) {
+		sched->deadline[i] = SCHED_NEVER;
+	}
+}
+
+void SCHEDSet(SCHED* sched, unsigned int id, u64 deadline)
+{
+	u64 old = sched->deadline[id];
+	sched->deadline[id] = deadline;
+
+	if(deadline < sched->next) {
+		sched->next = deadline;
+	} else if(old == sched->next) {
+		SCHEDUpdate(sched);
+	}
+}
+
+void SCHEDCancel(SCHED* sched, unsigned int id)
+{
+	SCHEDSet(sched, id, SCHED_NEVER);
+}
+
+void SCHEDRun(SCHED* sched, void* context, u64 now)
+{
+	while(sched->next <= now) {
+		unsigned int id = 0;
+		for(unsigned int i = 1; i < EVT_COUNT; i++) {
+			if(sched->deadline[i] < sched->deadline[id]) {
+				id = i;
+			}
+		}
+
+		u64 deadline = sched->deadline[id];
+		sched->deadline[id] = SCHED_NEVER;
+		SCHEDUpdate(sched);
+
+		sched->handler[id](context, id, deadline);
+	}
+}
@@ -0,0 +1,167 @@
+#define	_XOPEN_SOURCE	600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "types.h"
+#include "serial.h"
+
+static int SEROpenPTY(char* name, size_t size)
+{
+	int fd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(fd < 0 || grantpt(fd) || unlockpt(fd)) {
+		return -1;
+	}
+
+	/* raw bytes, no echo or line editing */
+	struct termios tio;
+	if(!tcgetattr(fd, &tio)) {
+		cfmakeraw(&tio);
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+
+	snprintf(name, size, "%s", ptsname(fd));
+	return fd;
+}
+
+static int SERConnect(const char* path)
+{
+	struct sockaddr_un addr;
+	if(strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if(connect(fd, (struct sockaddr*) &addr, sizeof(addr))) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+/* spec: "pty" creates a pseudo terminal, "unix:<path>" connects to a
+ * stream socket, anything else is opened as a file (FIFO, tty, ...). */
+void SERAttach(Emulator* ctx, const char* spec)
+{
+	SERIAL* ser = (SERIAL*) calloc(1, sizeof(SERIAL));
+	if(!ser) {
+		printf("Error allocating serial bridge: out of memory\n");
+		exit(1);
+	}
+
+	if(!strcmp(spec, "pty")) {
+		ser->fd = SEROpenPTY(ser->name, sizeof(ser->name));
+	} else if(!strncmp(spec, "unix:", 5)) {
+		snprintf(ser->name, sizeof(ser->name), "%s", spec + 5);
+		ser->fd = SERConnect(ser->name);
+	} else {
+		snprintf(ser->name, sizeof(ser->name), "%s", spec);
+		ser->fd = open(ser->name, O_RDWR | O_NOCTTY | O_NONBLOCK);
+	}
+
+	if(ser->fd < 0) {
+		printf("Error opening serial bridge %s: %s\n", spec, strerror(errno));
+		exit(1);
+	}
+
+	fcntl(ser->fd, F_SETFL, fcntl(ser->fd, F_GETFL) | O_NONBLOCK);
+
+	ctx->serial = ser;
+
+	printf("Serial bridge: %s\n", ser->name);
+}
+
+void SERDetach(Emulator* ctx)
+{
+	SERIAL* ser = ctx->serial;
+	if(!ser) {
+		return;
+	}
+
+	SERFlush(ctx);
+	close(ser->fd);
+	free(ser);
+
+	ctx->serial = NULL;
+}
+
+/* Next received byte, refilling the buffer from the host when it ran
+ * empty. Returns FALSE if no data is available right now. */
+BOOL SERReceive(Emulator* ctx, u8* data)
+{
+	SERIAL* ser = ctx->serial;
+	if(!ser) {
+		return FALSE;
+	}
+
+	if(ser->rx_head == ser->rx_tail) {
+		ssize_t n = read(ser->fd, ser->rx, SER_BUFFER_SIZE);
+		if(n <= 0) {
+			return FALSE;
+		}
+		ser->rx_head = 0;
+		ser->rx_tail = n;
+	}
+
+	*data = ser->rx[ser->rx_head++];
+	return TRUE;
+}
+
+void SERTransmit(Emulator* ctx, u8 data)
+{
+	SERIAL* ser = ctx->serial;
+	if(!ser) {
+		return;
+	}
+
+	if(ser->tx_count == SER_BUFFER_SIZE) {
+		SERFlush(ctx);
+	}
+	ser->tx[ser->tx_count++] = data;
+}
+
+/* Writes out the transmit buffer. A peer which does not keep up (or is not
+ * connected, e.g. a pty without an open slave) loses the data, the
+ * emulation never blocks on the host. */
+void SERFlush(Emulator* ctx)
+{
+	SERIAL* ser = ctx->serial;
+	if(!ser || !ser->tx_count) {
+		return;
+	}
+
+	u32 offset = 0;
+	while(offset < ser->tx_count) {
+		ssize_t n = write(ser->fd, ser->tx + offset, ser->tx_count - offset);
+		if(n <= 0) {
+			break;
+		}
+		offset += n;
+	}
+
+#ifdef DEBUG_SERIAL
+	if(offset < ser->tx_count) {
+		printf("SERIAL: %u bytes dropped\n", ser->tx_count - offset);
+	}
+#endif
+
+	ser->tx_count = 0;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "types.h"
+#include "shm.h"
+
+#define	SHM_SIZE	(SHM_RAM_OFFSET + EMU_RAM_SIZE)
+
+void SHMAttach(Emulator* ctx, const char* name)
+{
+	/* never attach to an object of another instance */
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if(fd < 0 && errno == EEXIST) {
+		printf("Error opening shared memory %s: already in use by another instance or left behind, remove /dev/shm%s if it is stale\n", name, name);
+		exit(1);
+	} else if(fd < 0) {
+		printf("Error opening shared memory %s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+
+	if(ftruncate(fd, SHM_SIZE)) {
+		printf("Error resizing shared memory %s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+
+	u8* mem = (u8*) mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED) {
+		printf("Error mapping shared memory %s: %s\n", name, strerror(errno));
+		exit(1);
+	}
+
+	SHMHEADER* hdr = (SHMHEADER*) mem;
+	memset(hdr, 0, sizeof(SHMHEADER));
+	hdr->magic = SHM_MAGIC;
+	hdr->version = SHM_VERSION;
+	hdr->ram_offset = SHM_RAM_OFFSET;
+	hdr->ram_size = EMU_RAM_SIZE;
+
+	/* move the RAM into the shared object */
+	u8* ram = mem + SHM_RAM_OFFSET;
+	memcpy(ram, ctx->ram, EMU_RAM_SIZE);
+	if(ctx->own_ram) {
+		free(ctx->ram);
+	}
+	ctx->ram = ram;
+	ctx->own_ram = 0;
+
+	ctx->shm = hdr;
+	ctx->shm_name = name;
+	SCHEDSet(&ctx->sched, EVT_SHM, ctx->cycle);
+
+	printf("Shared memory view: %s\n", name);
+}
+
+void SHMDetach(Emulator* ctx)
+{
+	if(!ctx->shm) {
+		return;
+	}
+
+	munmap(ctx->shm, SHM_SIZE);
+	shm_unlink(ctx->shm_name);
+
+	SCHEDCancel(&ctx->sched, EVT_SHM);
+	ctx->shm = NULL;
+	ctx->ram = NULL;
+}
+
+void SHMUpdate(Emulator* ctx)
+{
+	SHMHEADER* hdr = ctx->shm;
+	ZZ80State* cpu = &ctx->z80->state;
+
+	hdr->seq++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	hdr->cycle = ctx->cycle;
+
+	hdr->pc = cpu->pc;
+	hdr->sp = cpu->sp;
+	hdr->af = cpu->af.value_uint16;
+	hdr->bc = cpu->bc.value_uint16;
+	hdr->de = cpu->de.value_uint16;
+	hdr->hl = cpu->hl.value_uint16;
+	hdr->ix = cpu->ix.value_uint16;
+	hdr->iy = cpu->iy.value_uint16;
+	hdr->af_ = cpu->af_.value_uint16;
+	hdr->bc_ = cpu->bc_.value_uint16;
+	hdr->de_ = cpu->de_.value_uint16;
+	hdr->hl_ = cpu->hl_.value_uint16;
+	hdr->i = cpu->i;
+	hdr->r = cpu->r;
+	hdr->iff = cpu->internal.iff1 | (cpu->internal.iff2 << 1);
+	hdr->im = cpu->internal.im;
+
+	memcpy(hdr->led_reg, ctx->led_reg, sizeof(hdr->led_reg));
+	memcpy(hdr->channel_cfg_h, ctx->channel_cfg_h, sizeof(hdr->channel_cfg_h));
+	memcpy(hdr->channel_cfg_l, ctx->channel_cfg_l, sizeof(hdr->channel_cfg_l));
+
+	for(unsigned int dmacs = 0; dmacs < 5; dmacs++) {
+		for(unsigned int i = 0; i < 4; i++) {
+			hdr->dma_addr[dmacs][i] = ctx->dma[dmacs].channel[i].addr;
+			hdr->dma_wc[dmacs][i] = ctx->dma[dmacs].channel[i].wc;
+		}
+	}
+
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	hdr->seq++;
+}
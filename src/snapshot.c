@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define	SNAP_X86
+#endif
+
+#include "types.h"
+#include "snapshot.h"
+
+/* RAM layout from FLOPPY.md */
+typedef struct {
+	u32		start;
+	const char*	name;
+} REGION;
+
+static const REGION regions[] = {
+	{ 0x00000, "ROM" },
+	{ 0x00400, "system" },
+	{ 0x00500, "OS" },
+	{ 0x02000, "lower bank" },
+	{ 0x10000, "A16 low" },
+	{ 0x12000, "upper bank" },
+	{ EMU_RAM_SIZE, NULL }
+};
+
+typedef struct {
+	char		name[16];
+	u32		offset;
+	u32		size;
+} SNAPREG;
+
+#define	REG(n, field)	{ n, offsetof(SNAPSHOT, field), sizeof(((SNAPSHOT*) NULL)->field) }
+
+static const SNAPREG cpu_regs[] = {
+	REG("PC", cpu.pc),
+	REG("SP", cpu.sp),
+	REG("AF", cpu.af),
+	REG("BC", cpu.bc),
+	REG("DE", cpu.de),
+	REG("HL", cpu.hl),
+	REG("IX", cpu.ix),
+	REG("IY", cpu.iy),
+	REG("AF'", cpu.af_),
+	REG("BC'", cpu.bc_),
+	REG("DE'", cpu.de_),
+	REG("HL'", cpu.hl_),
+	REG("I", cpu.i),
+	REG("R", cpu.r),
+	REG("IFF/IM", cpu.internal),
+	REG("CPUA16", cpua16),
+	REG("FORC16", forc16),
+	REG("KBDMUX", kbdmux),
+	REG("KEYBOARD", keyboard),
+	REG("KEYBOARD2", keyboard2),
+	REG("LED0CS", led_reg[0]),
+	REG("LED1CS", led_reg[1]),
+	REG("LED2CS", led_reg[2]),
+	REG("FDD TRACK", fdd_track),
+	REG("FDD STATE", fdd_state),
+	REG("SIO", sio.vector),
+	REG("SIO A", sio.channel_a),
+	REG("SIO B", sio.channel_b),
+	REG("PIO", pio),
+	REG("CTC", ctc.vector),
+	REG("IRQ PENDING", daisy.pending),
+	REG("IRQ SERVICE", daisy.service)
+};
+
+#define	CTCREG(n, field)	{ n, offsetof(CTCCH, field), sizeof(((CTCCH*) NULL)->field) }
+
+static const SNAPREG ctc_regs[] = {
+	CTCREG("RESET", reset),
+	CTCREG("TRIGGER", trigger),
+	CTCREG("EDGE", edge),
+	CTCREG("PRESCALER", prescaler),
+	CTCREG("MODE", mode),
+	CTCREG("INTERRUPT", interrupt),
+	CTCREG("TC", time_constant),
+	CTCREG("COUNTER", counter)
+};
+
+/* one pass over the snapshot fields, storing them into the file buffer or
+ * loading them from it */
+typedef struct {
+	u8*		pos;
+	BOOL		load;
+} SNAPIO;
+
+#define	FIELD(io, x)	SNAPField(io, &(x), sizeof(x))
+
+/* returns the index of the first byte >= pos where a and b are (un)equal */
+typedef size_t (*SNAPSCAN)(const u8* a, const u8* b, size_t pos, size_t len, BOOL equal);
+
+static size_t SNAPScanScalar(const u8* a, const u8* b, size_t pos, size_t len, BOOL equal)
+{
+	/* word sized steps while looking for a difference */
+	if(!equal) {
+		while(pos + 8 <= len) {
+			u64 x;
+			u64 y;
+			memcpy(&x, a + pos, 8);
+			memcpy(&y, b + pos, 8);
+			if(x != y) {
+				break;
+			}
+			pos += 8;
+		}
+	}
+
+	while(pos < len && (a[pos] == b[pos]) != equal) {
+		pos++;
+	}
+
+	return pos;
+}
+
+#ifdef SNAP_X86
+static size_t SNAPScanSSE2(const u8* a, const u8* b, size_t pos, size_t len, BOOL equal)
+{
+	u32 want = equal ? 0 : 0xFFFF;
+	while(pos + 16 <= len) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (a + pos));
+		__m128i y = _mm_loadu_si128((const __m128i*) (b + pos));
+		u32 mask = (u32) _mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+		if(mask != want) {
+			return pos + __builtin_ctz(mask ^ want);
+		}
+		pos += 16;
+	}
+
+	return SNAPScanScalar(a, b, pos, len, equal);
+}
+
+__attribute__((target("avx2")))
+static size_t SNAPScanAVX2(const u8* a, const u8* b, size_t pos, size_t len, BOOL equal)
+{
+	u32 want = equal ? 0 : 0xFFFFFFFF;
+	while(pos + 64 <= len) {
+		/* two vectors per iteration to keep the loads in flight */
+		__m256i x0 = _mm256_loadu_si256((const __m256i*) (a + pos));
+		__m256i y0 = _mm256_loadu_si256((const __m256i*) (b + pos));
+		__m256i x1 = _mm256_loadu_si256((const __m256i*) (a + pos + 32));
+		__m256i y1 = _mm256_loadu_si256((const __m256i*) (b + pos + 32));
+		u32 m0 = (u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x0, y0));
+		u32 m1 = (u32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(x1, y1));
+		if(m0 != want) {
+			return pos + __builtin_ctz(m0 ^ want);
+		}
+		if(m1 != want) {
+			return pos + 32 + __builtin_ctz(m1 ^ want);
+		}
+		pos += 64;
+	}
+
+	return SNAPScanSSE2(a, b, pos, len, equal);
+}
+#endif
+
+static SNAPSCAN SNAPGetScan(void)
+{
+	static SNAPSCAN scan = NULL;
+	if(!scan) {
+#ifdef SNAP_X86
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("avx2")) {
+			scan = SNAPScanAVX2;
+		} else if(__builtin_cpu_supports("sse2")) {
+			scan = SNAPScanSSE2;
+		} else {
+			scan = SNAPScanScalar;
+		}
+#else
+		scan = SNAPScanScalar;
+#endif
+	}
+	return scan;
+}
+
+static void SNAPField(SNAPIO* io, void* field, unsigned int size)
+{
+	u8 buf[8];
+
+	if(io->load) {
+		memcpy(buf, io->pos, size);
+	} else {
+		memcpy(buf, field, size);
+	}
+
+	switch(size) {
+		case 2: {
+			u16 v;
+			memcpy(&v, buf, 2);
+			v = U16L(v);
+			memcpy(buf, &v, 2);
+			break;
+		}
+		case 4: {
+			u32 v;
+			memcpy(&v, buf, 4);
+			v = U32L(v);
+			memcpy(buf, &v, 4);
+			break;
+		}
+		case 8: {
+			u64 v;
+			memcpy(&v, buf, 8);
+			v = U64L(v);
+			memcpy(buf, &v, 8);
+			break;
+		}
+	}
+
+	if(io->load) {
+		memcpy(field, buf, size);
+	} else {
+		memcpy(io->pos, buf, size);
+	}
+	io->pos += size;
+}
+
+static void SNAPFieldsSIO(SNAPIO* io, SIOCH* ch)
+{
+	FIELD(io, ch->ptrlatch);
+	FIELD(io, ch->crc_reset_code);
+	FIELD(io, ch->exi_enable);
+	FIELD(io, ch->tx_int_enable);
+	FIELD(io, ch->rx_int_mode);
+	FIELD(io, ch->rx_enable);
+	FIELD(io, ch->rts);
+	FIELD(io, ch->dtr);
+	FIELD(io, ch->sync_bits);
+	FIELD(io, ch->last_cts);
+	FIELD(io, ch->last_dcd);
+	FIELD(io, ch->rx_data);
+	FIELD(io, ch->rx_ready);
+	FIELD(io, ch->exi_pending);
+	FIELD(io, ch->rx_pending);
+	FIELD(io, ch->tx_pending);
+	FIELD(io, ch->rxne);
+	FIELD(io, ch->rx_first);
+	FIELD(io, ch->tx_busy);
+}
+
+static void SNAPFields(SNAPIO* io, SNAPSHOT* snap)
+{
+	FIELD(io, snap->magic);
+	FIELD(io, snap->version);
+	FIELD(io, snap->cycle);
+
+	/* CPU */
+	ZZ80State* cpu = &snap->cpu;
+	FIELD(io, cpu->pc);
+	FIELD(io, cpu->sp);
+	FIELD(io, cpu->af.value_uint16);
+	FIELD(io, cpu->bc.value_uint16);
+	FIELD(io, cpu->de.value_uint16);
+	FIELD(io, cpu->hl.value_uint16);
+	FIELD(io, cpu->ix.value_uint16);
+	FIELD(io, cpu->iy.value_uint16);
+	FIELD(io, cpu->af_.value_uint16);
+	FIELD(io, cpu->bc_.value_uint16);
+	FIELD(io, cpu->de_.value_uint16);
+	FIELD(io, cpu->hl_.value_uint16);
+	FIELD(io, cpu->r);
+	FIELD(io, cpu->i);
+	FIELD(io, cpu->memptr);
+
+	u8 internal = cpu->internal.halt | (cpu->internal.irq << 1) | (cpu->internal.nmi << 2)
+		| (cpu->internal.iff1 << 3) | (cpu->internal.iff2 << 4) | (cpu->internal.ei << 5)
+		| (cpu->internal.im << 6);
+	FIELD(io, internal);
+	if(io->load) {
+		cpu->internal.halt = internal;
+		cpu->internal.irq = internal >> 1;
+		cpu->internal.nmi = internal >> 2;
+		cpu->internal.iff1 = internal >> 3;
+		cpu->internal.iff2 = internal >> 4;
+		cpu->internal.ei = internal >> 5;
+		cpu->internal.im = internal >> 6;
+	}
+
+	/* latches and keyboard */
+	FIELD(io, snap->cpua16);
+	FIELD(io, snap->forc16);
+	FIELD(io, snap->kbdmux);
+	FIELD(io, snap->keyboard);
+	FIELD(io, snap->keyboard2);
+
+	for(unsigned int ch = 0; ch < 8; ch++) {
+		FIELD(io, snap->channel_cfg_h[ch]);
+		FIELD(io, snap->channel_cfg_l[ch]);
+	}
+	for(unsigned int i = 0; i < 3; i++) {
+		FIELD(io, snap->led_reg[i]);
+	}
+
+	FIELD(io, snap->fdd_track);
+	FIELD(io, snap->fdd_state);
+
+	/* SIO */
+	FIELD(io, snap->sio.vector);
+	FIELD(io, snap->sio.status_affects_vector);
+	SNAPFieldsSIO(io, &snap->sio.channel_a);
+	SNAPFieldsSIO(io, &snap->sio.channel_b);
+
+	/* PIO */
+	Z80PIO* pio = &snap->pio;
+	FIELD(io, pio->input_a);
+	FIELD(io, pio->input_b);
+	FIELD(io, pio->output_a);
+	FIELD(io, pio->output_b);
+	FIELD(io, pio->vector_a);
+	FIELD(io, pio->vector_b);
+	FIELD(io, pio->dir_a);
+	FIELD(io, pio->dir_b);
+	FIELD(io, pio->mode_a);
+	FIELD(io, pio->mode_b);
+	FIELD(io, pio->state);
+
+	/* CTC, the timer bookkeeping is not part of the snapshot */
+	FIELD(io, snap->ctc.vector);
+	FIELD(io, snap->ctc.latch);
+	for(unsigned int i = 0; i < 4; i++) {
+		CTCCH* ch = &snap->ctc.channel[i];
+		FIELD(io, ch->reset);
+		FIELD(io, ch->trigger);
+		FIELD(io, ch->edge);
+		FIELD(io, ch->prescaler);
+		FIELD(io, ch->mode);
+		FIELD(io, ch->interrupt);
+		FIELD(io, ch->time_constant);
+		FIELD(io, ch->counter);
+	}
+
+	/* DMA, without the transfer schedule */
+	for(unsigned int dmacs = 0; dmacs < 5; dmacs++) {
+		DMA* dma = &snap->dma[dmacs];
+		FIELD(io, dma->mem2mem);
+		FIELD(io, dma->ch0addrhold);
+		FIELD(io, dma->disable);
+		FIELD(io, dma->timing);
+		FIELD(io, dma->priority);
+		FIELD(io, dma->write_sel);
+		FIELD(io, dma->dreq);
+		FIELD(io, dma->dack);
+		FIELD(io, dma->mode);
+		FIELD(io, dma->status);
+		FIELD(io, dma->tmp);
+
+		for(unsigned int i = 0; i < 4; i++) {
+			DMACH* ch = &dma->channel[i];
+			FIELD(io, ch->addr);
+			FIELD(io, ch->wc);
+			FIELD(io, ch->ff);
+			FIELD(io, ch->req);
+			FIELD(io, ch->mask);
+			FIELD(io, ch->transfer);
+			FIELD(io, ch->autoinit);
+			FIELD(io, ch->addr_dec);
+			FIELD(io, ch->mode);
+		}
+	}
+
+	/* interrupt daisy chain */
+	FIELD(io, snap->daisy.pending);
+	FIELD(io, snap->daisy.service);
+	for(unsigned int i = 0; i < IRQ_COUNT; i++) {
+		FIELD(io, snap->daisy.vector[i]);
+	}
+
+	if(io->load) {
+		memcpy(snap->ram, io->pos, EMU_RAM_SIZE);
+	} else {
+		memcpy(io->pos, snap->ram, EMU_RAM_SIZE);
+	}
+	io->pos += EMU_RAM_SIZE;
+}
+
+void SNAPTake(SNAPSHOT* snap, Emulator* ctx)
+{
+	memset(snap, 0, offsetof(SNAPSHOT, ram));
+
+	snap->magic = SNAP_MAGIC;
+	snap->version = SNAP_VERSION;
+	snap->cycle = ctx->cycle;
+	snap->cpu = ctx->z80->state;
+
+	snap->cpua16 = ctx->cpua16;
+	snap->forc16 = ctx->forc16;
+	snap->kbdmux = ctx->kbdmux;
+	snap->keyboard = ctx->keyboard;
+	snap->keyboard2 = ctx->keyboard2;
+
+	memcpy(snap->channel_cfg_h, ctx->channel_cfg_h, sizeof(snap->channel_cfg_h));
+	memcpy(snap->channel_cfg_l, ctx->channel_cfg_l, sizeof(snap->channel_cfg_l));
+	memcpy(snap->led_reg, ctx->led_reg, sizeof(snap->led_reg));
+
+	snap->fdd_track = ctx->fdd.track;
+	snap->fdd_state = ctx->fdd.state;
+
+	snap->sio = ctx->sio;
+	snap->pio = ctx->pio;
+	snap->ctc = ctx->ctc;
+	snap->daisy = ctx->daisy;
+	memcpy(snap->dma, ctx->dma, sizeof(snap->dma));
+
+	/* running timers as the CPU would read them, without the bookkeeping */
+	for(unsigned int i = 0; i < 4; i++) {
+		CTCCH* ch = &snap->ctc.channel[i];
+		ch->counter = EMUReadCTC(ctx, i);
+		ch->cycle_counter = 0;
+		ch->sync = 0;
+	}
+
+	for(unsigned int dmacs = 0; dmacs < 5; dmacs++) {
+		for(unsigned int i = 0; i < 4; i++) {
+			snap->dma[dmacs].channel[i].next = 0;
+		}
+	}
+
+	memcpy(snap->ram, ctx->ram, EMU_RAM_SIZE);
+}
+
+BOOL SNAPSave(const SNAPSHOT* snap, const char* filename)
+{
+	FILE* f = fopen(filename, "wb");
+	if(!f) {
+		printf("Error opening snapshot %s: %s\n", filename, strerror(errno));
+		return FALSE;
+	}
+
+	/* the file has no padding, it is never larger than the structure */
+	u8* buf = (u8*) malloc(sizeof(SNAPSHOT));
+	if(!buf) {
+		printf("Error saving snapshot %s: out of memory\n", filename);
+		fclose(f);
+		return FALSE;
+	}
+
+	SNAPIO io = { buf, FALSE };
+	SNAPFields(&io, (SNAPSHOT*) snap);
+
+	BOOL ok = fwrite(buf, io.pos - buf, 1, f) == 1;
+	fclose(f);
+	free(buf);
+
+	return ok;
+}
+
+BOOL SNAPLoad(SNAPSHOT* snap, const char* filename)
+{
+	FILE* f = fopen(filename, "rb");
+	if(!f) {
+		printf("Error opening snapshot %s: %s\n", filename, strerror(errno));
+		return FALSE;
+	}
+
+	u8* buf = (u8*) calloc(1, sizeof(SNAPSHOT));
+	if(!buf) {
+		printf("Error loading snapshot %s: out of memory\n", filename);
+		fclose(f);
+		return FALSE;
+	}
+
+	size_t len = fread(buf, 1, sizeof(SNAPSHOT), f);
+	fclose(f);
+
+	memset(snap, 0, offsetof(SNAPSHOT, ram));
+
+	SNAPIO io = { buf, TRUE };
+	SNAPFields(&io, snap);
+	free(buf);
+
+	if((size_t) (io.pos - buf) != len || snap->magic != SNAP_MAGIC || snap->version != SNAP_VERSION) {
+		printf("Invalid snapshot %s\n", filename);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+const char* SNAPRegion(u32 addr)
+{
+	const char* name = NULL;
+	for(const REGION* r = regions; r->name && r->start <= addr; r++) {
+		name = r->name;
+	}
+	return name;
+}
+
+unsigned int SNAPDiffRAM(const u8* a, const u8* b, size_t len, SNAPRANGE* ranges, unsigned int max)
+{
+	SNAPSCAN scan = SNAPGetScan();
+	unsigned int count = 0;
+	size_t pos = 0;
+
+	while(count < max) {
+		size_t start = scan(a, b, pos, len, FALSE);
+		if(start >= len) {
+			break;
+		}
+
+		pos = scan(a, b, start, len, TRUE);
+
+		ranges[count].start = start;
+		ranges[count].len = pos - start;
+		count++;
+	}
+
+	return count;
+}
+
+static void SNAPPrintReg(const char* name, const u8* a, const u8* b, u32 size)
+{
+	if(size > 8) {
+		printf("  %-14s differs\n", name);
+	} else {
+		u64 x = 0;
+		u64 y = 0;
+		memcpy(&x, a, size);
+		memcpy(&y, b, size);
+		printf("  %-14s %0*llX => %0*llX\n", name, size * 2, (unsigned long long) x, size * 2, (unsigned long long) y);
+	}
+}
+
+static unsigned int SNAPDiffReg(const SNAPSHOT* a, const SNAPSHOT* b, const char* name, u32 offset, u32 size)
+{
+	const u8* x = (const u8*) a + offset;
+	const u8* y = (const u8*) b + offset;
+	if(!memcmp(x, y, size)) {
+		return 0;
+	}
+
+	SNAPPrintReg(name, x, y, size);
+	return 1;
+}
+
+unsigned int SNAPDiff(const SNAPSHOT* a, const SNAPSHOT* b)
+{
+	unsigned int count = 0;
+	char name[16];
+
+	printf("Cycle: %llu => %llu\n", (unsigned long long) a->cycle, (unsigned long long) b->cycle);
+
+	printf("Registers:\n");
+	for(unsigned int i = 0; i < sizeof(cpu_regs) / sizeof(*cpu_regs); i++) {
+		const SNAPREG* r = &cpu_regs[i];
+		count += SNAPDiffReg(a, b, r->name, r->offset, r->size);
+	}
+
+	for(unsigned int ch = 0; ch < 8; ch++) {
+		sprintf(name, "CH%uCSL", ch);
+		count += SNAPDiffReg(a, b, name, offsetof(SNAPSHOT, channel_cfg_l) + ch, 1);
+		sprintf(name, "CH%uCSH", ch);
+		count += SNAPDiffReg(a, b, name, offsetof(SNAPSHOT, channel_cfg_h) + ch, 1);
+	}
+
+	for(unsigned int ch = 0; ch < 4; ch++) {
+		u32 chbase = offsetof(SNAPSHOT, ctc.channel) + ch * sizeof(CTCCH);
+		for(unsigned int i = 0; i < sizeof(ctc_regs) / sizeof(*ctc_regs); i++) {
+			const SNAPREG* r = &ctc_regs[i];
+			sprintf(name, "CTC%u %s", ch, r->name);
+			count += SNAPDiffReg(a, b, name, chbase + r->offset, r->size);
+		}
+	}
+
+	for(unsigned int dmacs = 0; dmacs < 5; dmacs++) {
+		u32 base = offsetof(SNAPSHOT, dma) + dmacs * sizeof(DMA);
+		sprintf(name, "DMA %u CMD", dmacs);
+		count += SNAPDiffReg(a, b, name, base, offsetof(DMA, channel));
+
+		for(unsigned int ch = 0; ch < 4; ch++) {
+			u32 chbase = base + offsetof(DMA, channel) + ch * sizeof(DMACH);
+			sprintf(name, "DMA %u CH%u ADDR", dmacs, ch);
+			count += SNAPDiffReg(a, b, name, chbase + offsetof(DMACH, addr), sizeof(u16));
+			sprintf(name, "DMA %u CH%u WC", dmacs, ch);
+			count += SNAPDiffReg(a, b, name, chbase + offsetof(DMACH, wc), sizeof(u16));
+			sprintf(name, "DMA %u CH%u", dmacs, ch);
+			count += SNAPDiffReg(a, b, name, chbase + offsetof(DMACH, ff), offsetof(DMACH, mode) + 1 - offsetof(DMACH, ff));
+		}
+	}
+
+	printf("RAM:\n");
+
+	SNAPRANGE ranges[256];
+	size_t pos = 0;
+	while(pos < EMU_RAM_SIZE) {
+		unsigned int n = SNAPDiffRAM(a->ram + pos, b->ram + pos, EMU_RAM_SIZE - pos, ranges, 256);
+		for(unsigned int i = 0; i < n; i++) {
+			u32 start = pos + ranges[i].start;
+			u32 end = start + ranges[i].len;
+
+			/* split ranges at region boundaries */
+			const REGION* r = regions;
+			while(r[1].start <= start) {
+				r++;
+			}
+			while(start < end) {
+				u32 stop = end < r[1].start ? end : r[1].start;
+				printf("  %05X-%05X [%5u bytes] %s\n", start, stop - 1, stop - start, r->name);
+				start = stop;
+				r++;
+			}
+		}
+
+		count += n;
+		if(n < 256) {
+			break;
+		}
+		pos += ranges[n - 1].start + ranges[n - 1].len;
+	}
+
+	return count;
+}
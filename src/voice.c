@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "types.h"
+#include "voice.h"
+#include "dac.h"
+#include "mixer.h"
+
+typedef struct {
+	u32	riff;
+	u32	riff_size;
+	u32	wave;
+	u32	fmt;
+	u32	fmt_size;
+	u16	format;
+	u16	channels;
+	u32	rate;
+	u32	byte_rate;
+	u16	block_align;
+	u16	bits;
+	u32	data;
+	u32	data_size;
+} ATTRIBUTE_PACKED WAVHEADER;
+
+/* VCF cutoff per VCF CTL setting (FC = 7 - D[7..5] of CHnCSH), 0: open.
+ * The filter board is approximated by a one pole low pass. */
+static const f32 vcf_cutoff[8] = { 500, 800, 1300, 2000, 3200, 5000, 8000, 0 };
+
+/* start (loop = 0) or loop (loop = 1) DMA channel of a voice */
+static DMACH* VOCChannel(Emulator* ctx, unsigned int ch, unsigned int loop)
+{
+	return &ctx->dma[ch / 2].channel[(ch % 2 ? 2 : 0) + loop];
+}
+
+static void VOCWriteHeader(VOICES* vc)
+{
+	WAVHEADER hdr = {
+		.riff = U32B(0x52494646),	/* "RIFF" */
+		.riff_size = U32L(sizeof(WAVHEADER) - 8 + vc->data_size),
+		.wave = U32B(0x57415645),	/* "WAVE" */
+		.fmt = U32B(0x666D7420),	/* "fmt " */
+		.fmt_size = U32L(16),
+		.format = U16L(1),		/* PCM */
+		.channels = U16L(1),
+		.rate = U32L(VOC_RATE),
+		.byte_rate = U32L(VOC_RATE * sizeof(s16)),
+		.block_align = U16L(sizeof(s16)),
+		.bits = U16L(16),
+		.data = U32B(0x64617461),	/* "data" */
+		.data_size = U32L(vc->data_size)
+	};
+
+	fseek(vc->file, 0, SEEK_SET);
+	fwrite(&hdr, sizeof(hdr), 1, vc->file);
+	fseek(vc->file, 0, SEEK_END);
+}
+
+void VOCOpen(Emulator* ctx, const char* filename)
+{
+	VOICES* vc;
+	if(posix_memalign((void**) &vc, 32, sizeof(VOICES))) {
+		printf("Error allocating voices: out of memory\n");
+		exit(1);
+	}
+	memset(vc, 0, sizeof(VOICES));
+
+	vc->file = fopen(filename, "wb");
+	if(!vc->file) {
+		printf("Error opening audio output %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	VOCWriteHeader(vc);
+
+	DACInit();
+	MIXInit();
+
+	ctx->voices = vc;
+
+	vc->base = vc->frames - ctx->cycle * VOC_RATE / CPU_CLOCK;
+	for(unsigned int ch = 0; ch < VOC_COUNT; ch++) {
+		VOCUpdate(ctx, ch);
+	}
+
+	SCHEDSet(&ctx->sched, EVT_VOICE, ctx->cycle + VOC_SYNC_CYCLES);
+}
+
+void VOCClose(Emulator* ctx)
+{
+	VOICES* vc = ctx->voices;
+	if(!vc) {
+		return;
+	}
+
+	VOCRender(ctx);
+	VOCFlush(ctx);
+	fclose(vc->file);
+	free(vc);
+
+	ctx->voices = NULL;
+}
+
+/* The clock starts over at 0 after a reset, the stream continues. */
+void VOCReset(Emulator* ctx)
+{
+	VOICES* vc = ctx->voices;
+
+	vc->base = vc->frames;
+	for(unsigned int ch = 0; ch < VOC_COUNT; ch++) {
+		vc->voice[ch].running = 0;
+		VOCUpdate(ctx, ch);
+	}
+
+	SCHEDSet(&ctx->sched, EVT_VOICE, ctx->cycle + VOC_SYNC_CYCLES);
+}
+
+/* Picks up a CHnCSL/CHnCSH change. Everything up to now has to be rendered
+ * already. Releasing ~RSTCHn starts the voice at the current address and
+ * count of its start channel. */
+void VOCUpdate(Emulator* ctx, unsigned int ch)
+{
+	VOICE* v = &ctx->voices->voice[ch];
+	u8 chncsh = ctx->channel_cfg_h[ch];
+	u16 timer = ((chncsh << 8) | ctx->channel_cfg_l[ch]) & 0x3FF;
+
+	/* 11.55MHz / (0x1000 - (0xC00 | timer)) */
+	v->step = ((u64) VOC_CLOCK << 32) / ((u64) (0x400 - timer) * VOC_RATE);
+
+	f32 cutoff = vcf_cutoff[7 - (chncsh >> 5)];
+	v->coeff = cutoff ? 1.0f - expf(-2.0f * (f32) M_PI * cutoff / VOC_RATE) : 1.0f;
+
+	f32 target = (chncsh & _BV(3)) ? 1.0f : 0.0f;
+	if(target != v->target) {
+		v->target = target;
+		v->ramp = VOC_RAMP;
+	}
+
+	if(!(chncsh & _BV(2))) {
+		v->running = 0;
+		v->sample = 0;
+		return;
+	}
+
+	if(!v->running) {
+		DMACH* dch = VOCChannel(ctx, ch, 0);
+		v->running = 1;
+		v->loop = 0;
+		v->dec = dch->addr_dec;
+		v->addr = dch->addr;
+		v->left = dch->wc + 1;
+		v->phase = 0;
+	}
+}
+
+/* Fetches the n-th next byte of a voice. The loop channel is read on every
+ * wrap, so the OS may move the loop while the voice plays. */
+static void VOCAdvance(Emulator* ctx, unsigned int ch, VOICE* v, u64 n)
+{
+	if(n > v->left) {
+		n -= v->left;
+
+		DMACH* dch = VOCChannel(ctx, ch, 1);
+		v->loop = 1;
+		v->dec = dch->addr_dec;
+		v->addr = dch->addr;
+		v->left = dch->wc + 1;
+
+		n = (n - 1) % v->left + 1;
+	}
+
+	u16 addr = v->dec ? v->addr - (u16) (n - 1) : v->addr + (u16) (n - 1);
+	v->addr = v->dec ? addr - 1 : addr + 1;
+	v->left -= n;
+
+	u32 a = addr | ((ctx->channel_cfg_h[ch] & _BV(4)) ? 0x10000 : 0);
+	v->sample = a < 1024 ? ctx->rom[a] : ctx->ram[a];
+}
+
+/* Produces the row of a voice, returns FALSE if it is silent. */
+static BOOL VOCRenderVoice(Emulator* ctx, unsigned int ch, f32* row, unsigned int frames)
+{
+	VOICES* vc = ctx->voices;
+	VOICE* v = &vc->voice[ch];
+
+	if(!v->running) {
+		return FALSE;
+	}
+
+	for(unsigned int i = 0; i < frames; i++) {
+		v->phase += v->step;
+		if(v->phase >> 32) {
+			VOCAdvance(ctx, ch, v, v->phase >> 32);
+			v->phase &= 0xFFFFFFFF;
+		}
+		vc->dac[i] = v->sample;
+	}
+
+	DACDecodeFloat(row, vc->dac, frames);
+
+	if(v->coeff < 1.0f) {
+		f32 y = v->y;
+		for(unsigned int i = 0; i < frames; i++) {
+			y += v->coeff * (row[i] - y);
+			row[i] = y;
+		}
+		v->y = y;
+	} else {
+		v->y = row[frames - 1];
+	}
+
+	return v->gain != 0 || v->ramp;
+}
+
+/* Renders all frames up to the current cycle. A block ends early when a
+ * gate ramp completes, so that the gains are exact at block boundaries. */
+void VOCRender(Emulator* ctx)
+{
+	VOICES* vc = ctx->voices;
+	u64 target = vc->base + ctx->cycle * VOC_RATE / CPU_CLOCK;
+
+	while(vc->frames < target) {
+		unsigned int frames = VOC_BLOCK;
+		if(target - vc->frames < frames) {
+			frames = target - vc->frames;
+		}
+		for(unsigned int ch = 0; ch < VOC_COUNT; ch++) {
+			VOICE* v = &vc->voice[ch];
+			if(v->ramp && v->ramp < frames) {
+				frames = v->ramp;
+			}
+		}
+
+		unsigned int count = 0;
+		for(unsigned int ch = 0; ch < VOC_COUNT; ch++) {
+			VOICE* v = &vc->voice[ch];
+			f32 step = v->ramp ? (v->target - v->gain) / v->ramp : 0;
+
+			if(VOCRenderVoice(ctx, ch, vc->pcm[count], frames)) {
+				vc->gain[count] = v->gain;
+				vc->step_gain[count] = step;
+				count++;
+			}
+
+			if(v->ramp) {
+				v->ramp -= frames;
+				v->gain = v->ramp ? v->gain + frames * step : v->target;
+			}
+		}
+
+		/* eight full scale voices can not clip */
+		MIXBlock(vc->out, &vc->pcm[0][0], VOC_BLOCK, vc->gain, vc->step_gain, count, frames, 32768.0f / VOC_COUNT);
+		for(unsigned int i = 0; i < frames; i++) {
+			vc->out[i] = U16L(vc->out[i]);
+		}
+
+		fwrite(vc->out, sizeof(s16), frames, vc->file);
+		vc->data_size += frames * sizeof(s16);
+		vc->frames += frames;
+	}
+}
+
+/* Makes the file a complete WAV file up to here. */
+void VOCFlush(Emulator* ctx)
+{
+	VOICES* vc = ctx->voices;
+	if(!vc) {
+		return;
+	}
+
+	VOCWriteHeader(vc);
+	fflush(vc->file);
+}
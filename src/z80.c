@@ -44,6 +44,7 @@ typedef u8 (* Instruction)(Z80 *object);
 #define READ_OFFSET(address)	((s8)READ_8(address))
 #define SET_HALT		if (object->halt != NULL) object->halt(object->context, TRUE )
 #define CLEAR_HALT		if (object->halt != NULL) object->halt(object->context, FALSE)
+#define SIGNAL_RETI		if (object->reti != NULL) object->reti(object->context)
 
 
 static inline u16 read_16bit(Z80 *object, u16 address)
@@ -1203,7 +1204,7 @@ INSTRUCTION(call_WORD)	 {PUSH(PC + 3); PC = READ_16(PC + 1);	    return 17;}
 INSTRUCTION(call_Z_WORD) {if (Z) return call_WORD(object); PC += 3; return 10;}
 INSTRUCTION(ret)	 {RET;					    return 10;}
 INSTRUCTION(ret_Z)	 {if (Z) {RET; return 11;} PC++;	    return  5;}
-INSTRUCTION(reti)	 {IFF1 = IFF2; RET;			    return 14;}
+INSTRUCTION(reti)	 {IFF1 = IFF2; RET; SIGNAL_RETI;		    return 14;}
 INSTRUCTION(retn)	 {IFF1 = IFF2; RET;			    return 14;}
 INSTRUCTION(rst_N)	 {PUSH(PC + 1); PC = BYTE0 & 56;	    return 11;}
 
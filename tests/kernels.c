@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "dac.h"
+#include "mixer.h"
+
+#define	DAC_SCALE	(1.0f / 32768.0f)
+
+#define	MIX_VOICES	8
+#define	MIX_FRAMES	67
+#define	MIX_STRIDE	(MIX_FRAMES + 5)
+
+static const char* dac_kernels[] = { "table", "sse2", "avx2" };
+static const char* mix_kernels[] = { "sse2", "avx2" };
+
+/* All 256 codes at every offset of a vector, so that both the vector loop
+ * and the scalar tail are covered. */
+static unsigned int TestDAC(const char* name)
+{
+	u8 in[256 + 64];
+	s16 out16[256 + 64];
+	f32 outf[256 + 64];
+	unsigned int errors = 0;
+
+	for(unsigned int offset = 0; offset < 64; offset++) {
+		for(unsigned int i = 0; i < 256; i++) {
+			in[offset + i] = i;
+		}
+
+		DACDecode(out16 + offset, in + offset, 256);
+		DACDecodeFloat(outf + offset, in + offset, 256);
+
+		for(unsigned int i = 0; i < 256; i++) {
+			s16 ref = DACReference(i);
+			if(out16[offset + i] != ref || outf[offset + i] != ref * DAC_SCALE) {
+				if(!errors) {
+					printf("DAC %s: %02X at offset %u decodes to %d / %f, expected %d\n", name, i, offset, out16[offset + i], outf[offset + i], ref);
+				}
+				errors++;
+			}
+		}
+	}
+
+	return errors;
+}
+
+static inline u32 Random(u32* seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 16;
+}
+
+/* Random voices with ramps, against the scalar kernel. The frame count is
+ * not a multiple of the vector width, so the tail is covered as well, and
+ * the larger scales clip. */
+static unsigned int TestMIX(const char* name)
+{
+	static f32 in[MIX_VOICES][MIX_STRIDE] ATTRIBUTE_ALGIN(32);
+	f32 gain[MIX_VOICES];
+	f32 step[MIX_VOICES];
+	s16 ref[MIX_FRAMES];
+	s16 out[MIX_FRAMES];
+	unsigned int errors = 0;
+
+	u32 seed = 1;
+	for(unsigned int v = 0; v < MIX_VOICES; v++) {
+		for(unsigned int i = 0; i < MIX_FRAMES; i++) {
+			in[v][i] = ((s32) (Random(&seed) % 65536) - 32768) / 32768.0f;
+		}
+		gain[v] = (Random(&seed) % 1024) / 1024.0f;
+		step[v] = ((s32) (Random(&seed) % 64) - 32) / 4096.0f;
+	}
+
+	for(unsigned int voices = 1; voices <= MIX_VOICES; voices++) {
+		for(f32 scale = 4096; scale <= 65536; scale *= 4) {
+			MIXSelect("scalar");
+			MIXBlock(ref, &in[0][0], MIX_STRIDE, gain, step, voices, MIX_FRAMES, scale);
+			MIXSelect(name);
+			MIXBlock(out, &in[0][0], MIX_STRIDE, gain, step, voices, MIX_FRAMES, scale);
+
+			for(unsigned int i = 0; i < MIX_FRAMES; i++) {
+				if(out[i] != ref[i]) {
+					if(!errors) {
+						printf("MIX %s: frame %u of %u voices at scale %.0f is %d, expected %d\n", name, i, voices, scale, out[i], ref[i]);
+					}
+					errors++;
+				}
+			}
+		}
+	}
+
+	return errors;
+}
+
+int main(void)
+{
+	unsigned int failed = 0;
+
+	for(unsigned int i = 0; i < sizeof(dac_kernels) / sizeof(*dac_kernels); i++) {
+		if(!DACSelect(dac_kernels[i])) {
+			printf("DAC %s: not supported, skipped\n", dac_kernels[i]);
+			continue;
+		}
+
+		unsigned int errors = TestDAC(dac_kernels[i]);
+		printf("DAC %s: %s\n", dac_kernels[i], errors ? "FAILED" : "ok");
+		failed += errors ? 1 : 0;
+	}
+
+	for(unsigned int i = 0; i < sizeof(mix_kernels) / sizeof(*mix_kernels); i++) {
+		if(!MIXSelect(mix_kernels[i])) {
+			printf("MIX %s: not supported, skipped\n", mix_kernels[i]);
+			continue;
+		}
+
+		unsigned int errors = TestMIX(mix_kernels[i]);
+		printf("MIX %s: %s\n", mix_kernels[i], errors ? "FAILED" : "ok");
+		failed += errors ? 1 : 0;
+	}
+
+	return failed ? 1 : 0;
+}